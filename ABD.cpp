@@ -394,7 +394,7 @@ const fuseMeaning ATmega8_fuses[] PROGMEM = {
 
 typedef struct {
    uint8_t           sig[3] ;
-   char              *desc ;
+   const char        *desc ;
    uint32_t           flashSize ;
    uint16_t           baseBootSize ;
    uint32_t           pageSize ;     // bytes
@@ -563,8 +563,7 @@ uint8_t printProgStr(const char * str) {
 // execute one programming instruction ... b1 is command, b2, b3, b4 are arguments
 //  processor may return a result on the 4th transfer, this is returned.
 uint8_t program(const uint8_t b1, const uint8_t b2 = 0, const uint8_t b3 = 0, const uint8_t b4 = 0) {
-  SPI.transfer(b1) ; SPI.transfer(b2) ; SPI.transfer(b3) ;
-  return SPI.transfer(b4) ;
+  return isp_cmd(b1, b2, b3, b4) ;  // see ISP_SPI.h
 }
 
 uint8_t readFlash(uint32_t  addr) {
@@ -575,14 +574,12 @@ uint8_t readFlash(uint32_t  addr) {
     lastAddressMSB = MSB ;
   }
 
-  uint8_t high = (addr & 1) ? 0x08 : 0 ;  // set if high byte wanted
-  addr >>= 1 ;  // turn into word address
-  return program(readProgramMemory | high, highByte(addr), lowByte(addr)) ;
+  return isp_read_flash(addr & 1, addr >> 1) ;  // high byte if odd, word address
 }
 
 void showHex(const uint8_t b, const boolean newline = false) {
   // try to avoid using sprintf
-  char buf[4] = { ((b >> 4) & 0x0F) | '0', (b & 0x0F) | '0', ' ' , 0 } ;
+  char buf[4] = { (char)(((b >> 4) & 0x0F) | '0'), (char)((b & 0x0F) | '0'), ' ' , 0 } ;
   if (buf[0] > '9') buf[0] += 7 ;
   if (buf[1] > '9') buf[1] += 7 ;
   Serial.print(buf) ;
@@ -590,8 +587,8 @@ void showHex(const uint8_t b, const boolean newline = false) {
 }
 
 void showBinary(const uint8_t b, const boolean newline = false) {
-  char buf[10] = { ((b >> 7) & 0x01) | '0', ((b >> 6) & 0x01) | '0', ((b >> 5) & 0x01) | '0', ((b >> 4) & 0x01) | '0',
-                   ((b >> 3) & 0x01) | '0', ((b >> 2) & 0x01) | '0', ((b >> 1) & 0x01) | '0',        (b & 0x01) | '0',
+  char buf[10] = { (char)(((b >> 7) & 0x01) | '0'), (char)(((b >> 6) & 0x01) | '0'), (char)(((b >> 5) & 0x01) | '0'), (char)(((b >> 4) & 0x01) | '0'),
+                   (char)(((b >> 3) & 0x01) | '0'), (char)(((b >> 2) & 0x01) | '0'), (char)(((b >> 1) & 0x01) | '0'), (char)((b & 0x01) | '0'),
                   ' ', 0 } ;
   Serial.print(buf) ;
   if (newline) Serial.println() ;
@@ -613,7 +610,6 @@ void readBootloader() {
 
   uint8_t fusenumber = currentSignature.fuseWithBootloaderSize ;
   uint8_t whichFuse ;
-  uint8_t hFuse = program(readHighFuseByte, readHighFuseByteArg2) ;
 
   switch (fusenumber) {
     case lowFuse:
@@ -714,14 +710,14 @@ void readProgram() {
 bool startProgramming()
   {
   Serial.print(F("Attempting to enter programming mode ...")) ;
-  digitalWrite(RESET, HIGH) ;  // ensure SS stays high for now
+  FastPin<RESET>::high() ;  // ensure SS stays high for now
   SPI.begin() ;
   SPI.setClockDivider(SPI_CLOCK_DIV64) ;
 
   uint8_t confirm ;
 
-  pinMode(RESET, OUTPUT) ;
-  pinMode(SCK, OUTPUT) ;
+  FastPin<RESET>::output() ;
+  FastPin<SCK>::output() ;
 
   uint8_t  timeout = 0 ;
 
@@ -730,10 +726,10 @@ bool startProgramming()
     delay(100) ;
 
     // ensure SCK low then pulse reset, see page 309 of datasheet
-    digitalWrite(SCK, LOW) ;
-    digitalWrite(RESET, HIGH) ;
+    FastPin<SCK>::low() ;
+    FastPin<RESET>::high() ;
     delay(1) ;  // pulse for at least 2 clock cycles
-    digitalWrite(RESET, LOW) ;
+    FastPin<RESET>::low() ;
 
     delay(25) ;  // wait at least 20 mS
     SPI.transfer(progamEnable) ;
@@ -776,6 +772,17 @@ void getSignature() {
   Serial.println(F("Unrecogized signature.")) ;
 }
 
+// Used by the ISP side to decide how to wait on writes -- parts flagged timedWrites above
+// can't be polled for completion and need the datasheet worst-case delay instead.
+bool needsTimedWrites(const uint8_t *sig) {
+  signatureType entry ;
+  for(uint8_t j = 0 ; j < NUMITEMS(signatures) ; j++) {
+    memcpy_P(&entry, &signatures[j], sizeof entry) ;
+    if (memcmp(sig, entry.sig, sizeof entry.sig) == 0) return entry.timedWrites ;
+  }
+  return false ;
+}
+
 void showFuseMeanings() {
   if (currentSignature.fusesInfo == NULL) {
      Serial.println(F("No fuse information for this processor."));
@@ -836,6 +843,46 @@ void getFuseBytes() {
   showFuseMeanings() ;
 }
 
+#ifdef SPI_BENCHMARK
+// the way program() and spi_transaction() used to do it, kept for comparison
+uint8_t __attribute__((noinline)) transferReadFlash(uint16_t addr, uint8_t high) {
+  SPI.transfer(readProgramMemory | (high ? 0x08 : 0)) ; SPI.transfer(highByte(addr)) ; SPI.transfer(lowByte(addr)) ;
+  return SPI.transfer(0) ;
+}
+
+// Read the first 1K of flash at each divider both ways and report bytes per second and CPU cycles
+// per byte.  Timed with micros(), so expect a percent or so of noise from the timer interrupt.
+// What's read back is summed for each way and printed after the timings: the two sums should
+// agree, and where they don't (or change from one divider to the next) the target couldn't keep
+// up at that rate.
+void spiBenchmark() {
+  const uint8_t  dividers[] = { SPI_CLOCK_DIV128, SPI_CLOCK_DIV64, SPI_CLOCK_DIV32, SPI_CLOCK_DIV16,
+                                SPI_CLOCK_DIV8,   SPI_CLOCK_DIV4,  SPI_CLOCK_DIV2 } ;
+  const uint16_t len = 1024 ;
+  uint16_t sum1, sum2 ;
+
+  Serial.println() ; Serial.println(F("SPI flash read benchmark (bytes/sec, cycles/byte):")) ;
+  for(uint8_t d = 0 ; d < NUMITEMS(dividers) ; d++) {
+    SPI.setClockDivider(dividers[d]) ;
+    sum1 = sum2 = 0 ;
+    uint32_t t0 = micros() ;
+    for(uint16_t i = 0 ; i < len ; i++) sum1 += transferReadFlash(i >> 1, i & 1) ;
+    uint32_t t1 = micros() ;
+    for(uint16_t i = 0 ; i < len ; i++) sum2 += isp_read_flash(i & 1, i >> 1) ;
+    uint32_t t2 = micros() ;
+
+    Serial.print(F("  SPI_CLOCK_DIV")) ; Serial.print(128 >> d) ;
+    Serial.print(F("\tSPI.transfer(): ")) ; Serial.print(len * 1000000UL / (t1 - t0)) ;
+    Serial.print(F(" (")) ; Serial.print((t1 - t0) * (F_CPU / 1000000UL) / len) ;
+    Serial.print(F(")\tstreaming: ")) ; Serial.print(len * 1000000UL / (t2 - t1)) ;
+    Serial.print(F(" (")) ; Serial.print((t2 - t1) * (F_CPU / 1000000UL) / len) ;
+    Serial.print(F(")\tsums: ")) ; Serial.print(sum1, HEX) ;
+    Serial.print(F(" ")) ; Serial.println(sum2, HEX) ;
+  }
+  SPI.setClockDivider(SPI_CLOCK_DIV64) ;
+}
+#endif /* SPI_BENCHMARK */
+
 void detectBoard() {
   Serial.begin(115200) ;
   while (!Serial) ;  // for Leonardo, Micro etc.
@@ -857,9 +904,13 @@ void detectBoard() {
     if (foundSig != -1) readBootloader() ;
 
     readProgram() ;
+
+#ifdef SPI_BENCHMARK
+    spiBenchmark() ;
+#endif
   }   // end of if entered programming mode OK
 
-  digitalWrite(RESET, HIGH) ;  //Disables reset line to secondary processor...
+  FastPin<RESET>::high() ;  //Disables reset line to secondary processor...
 
   SPI.end() ;
 
@@ -868,7 +919,7 @@ void detectBoard() {
 //  Serial.print(" DDRD: ") ; showBinary(DDRD) ; Serial.print("  PORTD: ") ; showBinary(PORTD, true) ;
 
  // only need to see output once, so wait till switch released.
-  while (digitalRead(ABD_SELECTOR) == LOW) ;
+  while (FastPin<ABD_SELECTOR>::read() == LOW) ;
 
   delay(20) ; // make sure serial output complete before we chop it off...
   softwareReset() ;
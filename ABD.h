@@ -43,6 +43,7 @@ extern "C" {
 #define softwareReset(x)  do { wdt_enable(WDTO_15MS); for(;;); } while (0) ;
 
 void detectBoard() ;
+bool needsTimedWrites(const uint8_t *sig) ;
 
 // stringification for Arduino IDE version
 #define xstr(s) str(s)
@@ -7,8 +7,13 @@
 //    just the AVRISP portion of this code...  Saves roughly 18000 bytes.
 //#define STRIP_ABD
 
+// STRIP_STK500V2
+//    Leave out the STK500v2 command layer in STK500v2.ino, for hosts that only speak STK500v1
+//    (avrdude's arduino and stk500v1 programmers).
+//#define STRIP_STK500V2
+
 // Pins we use:
-#define CLOCK_1MHZ   3
+#define CLOCK_OUT    3
 #define RESET       SS
 #define LED_HB       9
 #define LED_ERR      8
@@ -17,6 +22,11 @@
 #define PIEZO       A0
 
 #include "pins_arduino.h"  // defines SS,MOSI,MISO,SCK
+#include "ISP_SPI.h"       // streaming SPI for ISP instructions
+#include "FastPin.h"       // compile-time pins
+extern "C" {
+  #include "md5.h"           // STK_CHECKSUM, and the Board Detector's bootloader sums
+}
 
 #ifndef STRIP_ABD
 #include "ABD.h"
@@ -24,6 +34,65 @@
 
 #define PROG_FLICKER true
 
+// Serial rate in ISP mode, avrdude's -b has to match.  19200 is what avrdude's arduino and stk500v1
+// programmers assume; 57600, 115200, 250000, 500000 and 1000000 all work on an UNO.  A host can
+// also switch rates during a session with STK_SET_PARAMETER 0xA3, see README.md.
+#define ISP_BAUD 19200
+
+// GANG_PROGRAMMING
+//    Program several targets at once, e.g. a panel of identical boards.  They share MOSI and SCK
+//    and each has its own RESET pin from GANG_RESETS.  Targets in programming mode all drive MISO,
+//    so each one's MISO has to go through a tri-state buffer (a 74HC125 gate, say) enabled by its
+//    pin in GANG_SELECTS, active low.  Page loads and commits go to every target at once, then
+//    each target is polled and its page read back one at a time.  See Gang.ino and README.md.
+//#define GANG_PROGRAMMING
+#define GANG_RESETS  { RESET, 2, 4, 5 }
+#define GANG_SELECTS { A1, A2, A3, A4 }
+
+// STAMP_MODE
+//    Keep a target image in a 25 series SPI flash chip and program boards from it with no host
+//    attached, one per press of STAMP_BUTTON (to ground).  The storage chip is bit-banged on pins
+//    of its own, the same pins as GANG_SELECTS, so not with GANG_PROGRAMMING.  See Stamp.ino
+//    and README.md.
+//#define STAMP_MODE
+#define STAMP_CS     A1
+#define STAMP_SCK    A2
+#define STAMP_MOSI   A3
+#define STAMP_MISO   A4
+#define STAMP_BUTTON A5
+
+#if defined(STAMP_MODE) && defined(GANG_PROGRAMMING)
+#error "STAMP_MODE and GANG_PROGRAMMING use the same pins"
+#endif
+
+// SPI_BENCHMARK
+//    Have the Board Detector time flash reads at every SPI clock divider, through SPI.transfer()
+//    and through the streaming instructions in ISP_SPI.h, and print bytes per second for each.
+//#define SPI_BENCHMARK
+
+// PERF_COUNTERS
+//    Keep count of where the time goes -- waiting on the host, on the UART, on the target, SPI
+//    bytes, commands by type, NOSYNC and UNKNOWN replies -- from each STK_GET_SYNC on, for the host
+//    to read back with STK_PERF_GET (0x8C).  Costs a few hundred bytes of flash, about 80 of RAM and
+//    a few microseconds a command.  See README.md.
+#define PERF_COUNTERS
+
+// Clock generated on CLOCK_OUT at startup, in MHz -- 1, 2, 4 or 8, or 0 for none.  The host
+// can change it with STK_SET_PARAMETER 0xA1.
+#define CLOCK_OUT_MHZ 1
+
+// Answer each flash STK_PROG_PAGE as soon as it has arrived and write it to the target while the
+// host sends the next one.  A page that fails is then reported on the next page's reply, or on
+// STK_PMODE_END if it was the last.  The host can change it with STK_SET_PARAMETER 0xA2.
+#define PIPELINE_WRITES true
+
+// Delta writes: before loading a flash page, compare it with what the target already holds (or,
+// after a chip erase, with 0xFF) and skip the load and commit if they're the same.  Saves time and
+// flash endurance reflashing nearly the same build.  Without a chip erase first, a page that needs a
+// cleared bit set again fails rather than being written over.  The host can change it with
+// STK_SET_PARAMETER 0xA4.
+#define DELTA_WRITES false
+
 #define HWVER 2
 #define SWMAJ 1
 #define SWMIN 18
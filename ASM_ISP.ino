@@ -17,7 +17,7 @@
 // MISO:        12:               50
 // SCK:         13:               52
 //
-// CLOCK_1MHZ    3:               .kbv
+// CLOCK_OUT     3:               .kbv -- 1MHz by default, see CLOCK_OUT_MHZ
 //
 // Put an LED (with resistor) on the following pins:
 //  9: Heartbeat   - shows the programmer is running
@@ -38,7 +38,6 @@
 // Conversion to SPI library from https://github.com/rsbohn/ArduinoISP
 //
 // Under Consideration:
-//     8MHz clock from https://github.com/adafruit/ArduinoISP
 //     Target serial support ala https://github.com/cloudformdesign/ArduinoISP and/or
 //         https://github.com/TheIronDuke5000/ArduinoISP-with-Serial-Debug
 //     Low Speed from https://github.com/adafruit/ArduinoISP
@@ -55,6 +54,7 @@
 //
 
 #include <SPI.h>
+#include <avr/eeprom.h>
 #include "ASM_ISP.h"
 
 // STK Definitions
@@ -67,6 +67,7 @@ const uint8_t CRC_EOP          = 0x20; // ' '
 
 const uint8_t STK_GET_SYNC     = 0x30; // '0'
 const uint8_t STK_GET_SIGNON   = 0x31; // '1'
+const uint8_t STK_SET_PARAMETER= 0x40; // '@'
 const uint8_t STK_GET_PARM     = 0x41; // 'A'
 const uint8_t STK_SET_PARM     = 0x42; // 'B'
 const uint8_t STK_SET_PARM_EXT = 0x45; // 'E'
@@ -80,8 +81,65 @@ const uint8_t STK_PROG_PAGE    = 0x64; // 'd'
 const uint8_t STK_READ_PAGE    = 0x74; // 't'
 const uint8_t STK_READ_SIGN    = 0x75; // 'u'
 
+// our own extensions, in opcodes the STK500 doesn't use -- see README.md
+const uint8_t STK_CHECKSUM     = 0x80;
+const uint8_t STK_VERIFY_PAGE  = 0x81;
+const uint8_t STK_VERIFY_RESULT= 0x82;
+const uint8_t STK_PAGE_COUNTS  = 0x83;
+const uint8_t STK_PROG_PACKED  = 0x84;
+const uint8_t STK_UNIVERSAL_BATCH = 0x85;
+const uint8_t STK_STAMP_ERASE  = 0x86;
+const uint8_t STK_STAMP_WRITE  = 0x87;
+const uint8_t STK_STAMP_READ   = 0x88;
+const uint8_t STK_STAMP        = 0x89;
+const uint8_t STK_SERIAL_SET   = 0x8A;
+const uint8_t STK_SERIAL_GET   = 0x8B;
+const uint8_t STK_PERF_GET     = 0x8C;
+
+// STK500v2 messages start with this instead, see STK500v2.ino
+const uint8_t  STK2_START      = 0x1B;
+const uint16_t STK2_MAX_BODY   = 256 + 10;  // CMD_PROGRAM_FLASH_ISP with a 256 byte page
+
+// STK500 framing -- how many argument bytes sit between each command and its CRC_EOP, so
+// getEOP() knows exactly where a frame ends rather than stopping at the first 0x20 (addresses,
+// universal instructions and device parameters can all contain one).  Anything not listed has
+// no arguments.  The ones we don't implement are here too so they're framed right, and the
+// default: case in avrisp() skips to the end of the frame before it answers STK_UNKNOWN, so they
+// don't knock us out of sync.
+#define FRAME_VAR 0xFF  // length is in the frame itself, see frame_byte()
+const uint8_t frame_table[][2] PROGMEM = {
+  { STK_SET_PARAMETER,  2 },
+  { STK_GET_PARM,       1 },
+  { STK_SET_PARM,      20 },
+  { STK_SET_PARM_EXT,   FRAME_VAR },  // first argument counts itself and the rest
+  { STK_SET_ADDR,       2 },
+  { STK_UNIVERSAL,      4 },
+  { 0x57,               FRAME_VAR },  // UNIVERSAL_MULTI -- first argument is the count less one
+  { STK_PROG_FLASH,     2 },
+  { STK_PROG_DATA,      1 },
+  { 0x62,               2 },          // PROG_FUSE
+  { 0x63,               1 },          // PROG_LOCK
+  { STK_PROG_PAGE,      FRAME_VAR },  // 16 bit length, memory type, then the data
+  { 0x65,               3 },          // PROG_FUSE_EXT
+  { STK_READ_PAGE,      3 },
+  { 0x78,               1 },          // READ_OSCCAL_EXT
+  { STK_CHECKSUM,      10 },          // memory type, digest, 32 bit address and length
+  { STK_VERIFY_PAGE,    FRAME_VAR },  // same as STK_PROG_PAGE
+  { STK_PROG_PACKED,    FRAME_VAR },  // same as STK_PROG_PAGE, length is the packed length
+  { STK_UNIVERSAL_BATCH, FRAME_VAR }, // instruction count, then 4 bytes each
+  { STK_SERIAL_SET,     8 },          // EEPROM offset, width, format, 32 bit next number
+#ifdef STAMP_MODE
+  { STK_STAMP_ERASE,    1 },          // 64K blocks
+  { STK_STAMP_WRITE,    FRAME_VAR },  // 24 bit address, 16 bit length, then the data
+  { STK_STAMP_READ,     5 },          // 24 bit address, 16 bit length
+#endif /* STAMP_MODE */
+#ifndef STRIP_STK500V2
+  { STK2_START,         FRAME_VAR },  // sequence, 16 bit body size, token, body, checksum
+#endif /* STRIP_STK500V2 */
+};
+
 // Flags indicating status of Error and Programming LEDs
-uint8_t error = 0, pmode = 0;
+volatile uint8_t error = 0, pmode = 0;
 
 // SPI.end() doesn't return it's pins back to previous state after it's called... presumably
 // not a huge problem, but does affect output voltage of at least pin 13 (UNO) on slave device,
@@ -90,14 +148,96 @@ uint8_t error = 0, pmode = 0;
 uint8_t preSPI_DDRB, preSPI_PORTB;
 
 // Addresses are weird b/c different platforms have different int size.
-unsigned int _addr;         // Allow avrisp platforms int to be used, whatever size
-uint8_t      _buffer[256];  // serial port buffer
-uint8_t      buff[256];     // temporary serial read buffer
-uint8_t      pBuffer = 0;   // buffer pointer -- needs to be big enough for buff size
-uint8_t      iBuffer = 0;   // buffer index   -- needs to be big enough for buff size
+// _addr is a word address; bits 16-23 come from the Load Extended Address instruction
+// (0x4D) the host sends through STK_UNIVERSAL for flash beyond 128K, bits 0-15 from
+// STK_SET_ADDR.  ext_addr is what the target was last told, like lastAddressMSB in ABD.cpp.
+uint32_t     _addr;
+uint8_t      ext_addr = 0;
 boolean      EOP_SEEN = false;
 
-#define beget16(addr) (*addr * 256 + *(addr+1) )
+// Serial receive ring.  getEOP() moves bytes out of HardwareSerial into it and the command
+// handlers parse them where they lie with getch(), so a page is copied once on its way to the
+// target instead of twice.  It holds two whole STK_PROG_PAGE frames, so the next page has
+// somewhere to land while the current one is still being written out of the ring.
+#define RING_SIZE (2 * (256 + 8))
+uint8_t      ring[RING_SIZE];
+uint16_t     pBuffer = 0;   // read index  -- next byte getch() hands out
+uint16_t     iBuffer = 0;   // write index -- where the next byte from the serial port goes
+#define ring_next(i) ((i) + 1 == RING_SIZE ? 0 : (i) + 1)
+
+uint16_t     frame_start = 0; // where the frame being received starts in the ring
+uint16_t     frame_n   = 0;   // bytes of it so far
+uint16_t     frame_len = 0;   // how long it is, command through CRC_EOP -- 0 until we know
+uint8_t      baud_lost = 0;   // replies in a row that were STK_NOSYNC or STK_UNKNOWN, see set_baud()
+uint32_t     baud_heard = 0;  // millis() when the host last sent us something or we last answered
+#ifdef STAMP_MODE
+uint8_t      stamping = 0;    // stamp_target() has the ring, see Stamp.ino
+#endif
+
+// Performance counters -- see PERF_COUNTERS in ASM_ISP.h.  Enough to tell whether a station is
+// held up by the serial link, by SPI or by the target, sent back by STK_PERF_GET and zeroed by
+// STK_GET_SYNC, so they cover one avrdude run.  The times are micros() totals over whole phases --
+// the wait for each frame, each command's handling, each wait for a write to finish -- since
+// timing every instruction would take longer than the instruction does at the fast SPI rates.
+// SPI is counted in bytes instead and turned into time on the wire when it's read back.
+#ifdef PERF_COUNTERS
+const uint8_t perf_commands[] PROGMEM = {
+  STK_GET_SYNC, STK_GET_SIGNON, STK_SET_PARAMETER, STK_GET_PARM, STK_SET_PARM, STK_SET_PARM_EXT,
+  STK_PMODE_START, STK_PMODE_END, STK_SET_ADDR, STK_UNIVERSAL, STK_PROG_PAGE, STK_READ_PAGE,
+  STK_READ_SIGN, STK_CHECKSUM, STK_VERIFY_PAGE, STK_PROG_PACKED, STK_UNIVERSAL_BATCH, STK2_START
+};
+#define PERF_COMMANDS sizeof(perf_commands)
+struct {
+  uint32_t wait_us;     // waiting on the host for a frame to finish arriving
+  uint32_t tx_us;       // waiting for room in Serial's transmit buffer in read_ahead()
+  uint32_t cmd_us;      // handling commands, from a whole frame to the last of its reply queued
+  uint32_t target_us;   // waiting on the target to finish writes, erases and fuses
+  uint32_t spi_bytes;
+  uint16_t nosync, unknown;
+  uint16_t underruns;   // getch() found the ring empty
+  uint16_t ring_max;    // most bytes waiting in the ring at once
+  uint16_t commands[PERF_COMMANDS + 1];  // by perf_commands[], anything else last
+} perf;
+#define PERF_START(t)   uint32_t t = micros()
+#define PERF_END(c, t)  (perf.c += micros() - (t))
+#define PERF_COUNT(c)   (perf.c++)
+#define PERF_SPI(n)     (perf.spi_bytes += (n))
+#define PERF_RESET()    memset(&perf, 0, sizeof(perf))
+#else
+#define PERF_START(t)
+#define PERF_END(c, t)
+#define PERF_COUNT(c)
+#define PERF_SPI(n)
+#define PERF_RESET()
+#endif /* PERF_COUNTERS */
+
+// Pipelined flash writes -- see PIPELINE_WRITES in ASM_ISP.h.  While a page is being written the
+// next frame keeps arriving into the ring behind it, and pipe_result holds how the last page went
+// until there's a reply to report it on.
+uint8_t      pipeline = PIPELINE_WRITES;
+uint8_t      writing = 0;          // a pipelined page is being written, see serial_fill()
+uint8_t      pipe_result = STK_OK;
+
+// Delta writes -- see DELTA_WRITES in ASM_ISP.h.  erased is set by a chip erase, so blank pages
+// can be skipped without reading them.  The page counts cover the last programming session, from
+// STK_PMODE_START until STK_PMODE_END and after, and go back to the host on STK_PAGE_COUNTS.
+uint8_t      delta = DELTA_WRITES;
+uint8_t      erased = 0;
+uint16_t     pages_written = 0, pages_skipped = 0;
+
+// Cleared while STK500v2 loads part of a page without writing it, see stk2_program().
+uint8_t      page_commit = 1;
+
+#ifdef GANG_PROGRAMMING
+// Gang programming -- see GANG_PROGRAMMING in ASM_ISP.h and Gang.ino.  gang_mask is who the host
+// wants programmed, gang_active who is still being programmed this session and gang_failed who
+// dropped out (never answered, or failed a write).  Reads come from gang_lead.
+const uint8_t gang_resets[]  = GANG_RESETS;
+const uint8_t gang_selects[] = GANG_SELECTS;
+#define GANG_SIZE sizeof(gang_resets)
+uint8_t      gang_mask = (1 << GANG_SIZE) - 1;
+uint8_t      gang_active = 0, gang_failed = 0, gang_lead = 0;
+#endif /* GANG_PROGRAMMING */
 typedef struct param {
   uint8_t  devicecode;
   uint8_t  revision;
@@ -111,55 +251,163 @@ typedef struct param {
   uint16_t eeprompoll;
   uint16_t pagesize;    // was int... maybe to catch 16th bit as negative? but
                         // my understanding of possible values (256, 128, .., 32)
-                        // means beget() will never set 16th bit. See write_flash()
+                        // means getch16() will never set 16th bit. See write_flash()
   uint16_t eepromsize;
   uint32_t flashsize;
+  uint8_t  eeprompage;  // from STK_SET_PARM_EXT, 0 if the part has no EEPROM page mode
 }
 parameter;
 
 parameter param;
 
-// this provides a heartbeat on pin 9, so you can tell the software is running.
+// Write completion -- rather than sleeping a fixed time after every write, ask the target with
+// Poll RDY/BSY (0xF0) when the host says the part supports polling.  Self-timed parts without
+// RDY/BSY get data polling (read back a written location until it stops returning the
+// flashpoll/eeprompoll value), and anything else -- including parts the ABD signature table
+// flags as timedWrites, like the ATmega8A -- falls back to the datasheet worst case.
+#define TWD_FLASH     5   // ms, worst case flash page write
+#define TWD_EEPROM   10   // ms, worst case EEPROM byte write
+#define TWD_FUSE      5   // ms, worst case fuse or lock bits write
+#define TWD_ERASE    10   // ms, worst case chip erase
+#define POLL_TIMEOUT 50   // ms, give up on a target that stays busy longer than this
+
+uint8_t  timed_writes = 0;  // set in start_pmode() from ABD's signature table
+uint8_t  poll_cmd = 0;      // read instruction for data polling, 0 if nothing to poll on
+uint8_t  poll_val;          // value we wrote there
+uint16_t poll_addr;
+
+// SPI clock.  start_pmode() starts at the slowest divider and steps up through this list for as
+// long as the target keeps echoing and reading back the same signature and calibration byte, then
+// settles one step below the fastest rate that passed -- a rate right at the target's limit can
+// get a few reads through and still garble a page.  The host can cap it with STK_SET_PARAMETER /
+// Parm_STK_SCK_DURATION (avrdude -B) and read it back either way.
+#define PMODE_ATTEMPTS 5  // reset pulses to try before giving up on the programming enable echo
+#define SPI_PROBES     4  // signature and calibration reads a rate has to pass
+const uint8_t spi_dividers[] = { SPI_CLOCK_DIV128, SPI_CLOCK_DIV64, SPI_CLOCK_DIV32, SPI_CLOCK_DIV16,
+                                 SPI_CLOCK_DIV8,   SPI_CLOCK_DIV4,  SPI_CLOCK_DIV2 };
+uint8_t spi_rate  = 0;                         // index into spi_dividers[], 128 >> spi_rate is the divider
+uint8_t spi_limit = sizeof(spi_dividers) - 1;  // fastest index the host allows
+
+// The LEDs and the piezo run off the Timer1 overflow interrupt, so nothing in the protocol loop
+// ever waits on them -- beep() and pulse() queue their work and return.  Timer1 runs fast PWM at
+// SCHED_HZ with ICR1 as TOP, which is also the heartbeat's PWM on OC1A, so LED_HB has to stay on
+// pin 9.  Every tick the piezo is toggled if a note is sounding, and each LED is set from its
+// blink count or, when it isn't blinking, from lamp (LED_PMODE), error (LED_ERR) or the fade
+// (LED_HB).  It's started for ISP mode only, the Board Detector drives the LEDs itself.
+#if LED_HB != 9
+  #error "LED_HB has to be on OC1A (pin 9), the heartbeat is Timer1's PWM"
+#endif
+#define SCHED_HZ    4000                       // 250us ticks
+#define SCHED_TICKS(ms) ((uint16_t)(ms) * (SCHED_HZ / 1000))
+#define NOTES       4                          // beeps queued at once, more are dropped
+#define HB_TICKS    SCHED_TICKS(10)            // between heartbeat fade steps
+
+volatile uint8_t lamp = 0;                     // LED_PMODE when it isn't blinking
+const uint8_t leds[3] = { LED_PMODE, LED_ERR, LED_HB };
+volatile uint8_t  blinks[3];                   // half blinks left for each LED, on then off
+volatile uint16_t blink_ticks[3];              // ticks in each half
+volatile uint16_t blink_left[3];               // ticks left in this half
+uint8_t leds_on = 0;                           // bit per LED, what the pins are set to now
+volatile uint16_t note_half[NOTES];            // ticks between piezo toggles, 0 for a rest
+volatile uint16_t note_ticks[NOTES];           // ticks left to sound
+volatile uint8_t  note_first = 0, notes = 0;
+uint16_t note_phase = 0;
+uint8_t piezo = LOW;
 uint8_t hbval = 128;
 int8_t hbdelta = 2;
-void heartbeat() {
-  if (hbval > 192) hbdelta = -hbdelta;
-  if (hbval < 32) hbdelta = -hbdelta;
-  hbval += hbdelta;
-  analogWrite(LED_HB, hbval);
-  delay(10);
-  // delay(40);
+uint8_t hbtick = 0;
+
+void sched_start() {
+  TCCR1A = _BV(COM1A1) | _BV(WGM11);              // fast PWM on OC1A, TOP is ICR1
+  TCCR1B = _BV(WGM13) | _BV(WGM12) | _BV(CS11);   // at clk/8
+  ICR1   = F_CPU / 8 / SCHED_HZ - 1;
+  OCR1A  = hbval * 2;
+  TIMSK1 = _BV(TOIE1);
+}
+
+ISR(TIMER1_OVF_vect) {
+  if (notes) {
+    if (note_half[note_first] && ++note_phase >= note_half[note_first]) {
+      note_phase = 0;
+      FastPin<PIEZO>::write(piezo = !piezo);
+    }
+    if (--note_ticks[note_first] == 0) {
+      FastPin<PIEZO>::write(piezo = LOW);
+      note_phase = 0;
+      note_first = (note_first + 1) % NOTES;
+      notes--;
+    }
+  }
+  for(uint8_t x = 0; x < 3; x++) { //**
+    uint8_t on;
+    if (blinks[x]) {
+      on = !(blinks[x] & 1);
+      if (--blink_left[x] == 0) {
+        blink_left[x] = blink_ticks[x];
+        blinks[x]--;
+      }
+    } else if (x == 2) {
+      // the heartbeat, so you can tell the software is running
+      leds_on &= ~_BV(2);
+      if (++hbtick >= HB_TICKS) {
+        hbtick = 0;
+        if (hbval > 192) hbdelta = -hbdelta;
+        if (hbval < 32) hbdelta = -hbdelta;
+        hbval += hbdelta;
+        OCR1A = hbval * 2;  // TOP is about twice analogWrite()'s
+      }
+      continue;
+    } else {
+      on = x ? (error != 0) : lamp;
+    }
+    if (on == ((leds_on >> x) & 1)) continue;
+    leds_on ^= _BV(x);
+    if (x == 2) OCR1A = on ? ICR1 : 0;
+    else if (x == 1) FastPin<LED_ERR>::write(on);
+    else FastPin<LED_PMODE>::write(on);
+  }
 }
 
 uint8_t getch() {
   if (pBuffer == iBuffer) {  // spin until data available ???
+    PERF_COUNT(underruns);
     pulse(LED_ERR, 1);
     beep(1700, 20);
     error++;
     return -1;
   }
-  uint8_t ch = _buffer[pBuffer];  // get next char
-  pBuffer = (++pBuffer)%256;  // increment and wrap
+  uint8_t ch = ring[pBuffer];  // get next char
+  pBuffer = ring_next(pBuffer);  // increment and wrap
   return ch;
 }
 
-void readbytes(uint8_t n) { //**
-  for(uint8_t x = 0; x < n; x++) { //**
-    buff[x] = getch();
-  }
+uint16_t getch16() { //** big endian, as the STK500 sends them
+  uint16_t hi = getch();
+  return hi * 256 + getch();
+}
+
+// ring index of the byte n ahead of index i
+uint16_t ring_at(uint16_t i, uint16_t n) { //**
+  n += i;
+  return n >= RING_SIZE ? n - RING_SIZE : n;
+}
+
+// the CRC_EOP of the frame being handled -- dispatch() has already moved frame_start past it
+uint16_t frame_eop() {
+  return ring_at(frame_start, RING_SIZE - 1);
 }
 
 #define PTIME 30
 // #define PTIME 50
-void pulse(uint8_t pin, uint8_t times, uint32_t ptime) { //**
-  do {
-    digitalWrite(pin, HIGH);
-    delay(ptime);
-    digitalWrite(pin, LOW);
-    delay(ptime);
-    times--;
+// blink an LED times times, ptime ms on and ptime ms off
+void pulse(uint8_t pin, uint8_t times, uint16_t ptime) { //**
+  for(uint8_t x = 0; x < 3; x++) { //**
+    if (leds[x] != pin) continue;
+    noInterrupts();
+    blink_ticks[x] = blink_left[x] = SCHED_TICKS(ptime);
+    blinks[x] = times * 2;
+    interrupts();
   }
-  while (times > 0);
 }
 void pulse(uint8_t pin, uint8_t times) { //**
   pulse(pin, times, PTIME);
@@ -167,31 +415,75 @@ void pulse(uint8_t pin, uint8_t times) { //**
 
 void prog_lamp(uint8_t state) { //**
   if (PROG_FLICKER)
-    digitalWrite(LED_PMODE, state);
+    lamp = state;
 }
 
 uint8_t spi_transaction(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
-  uint8_t n;
-  SPI.transfer(a);
-  n=SPI.transfer(b);
-  //if (n != a) error = -1;
-  n=SPI.transfer(c);
-  return SPI.transfer(d);
+  PERF_SPI(4);
+  return isp_cmd(a, b, c, d);  // see ISP_SPI.h
 }
 
-void replyOK() {
+// remember a written location for data polling, unless its value reads the same as busy
+void poll_on(uint8_t cmd, uint16_t addr, uint8_t val, uint8_t busy1, uint8_t busy2) {
+  if (val == busy1 || val == busy2) return;
+  poll_cmd = cmd; poll_addr = addr; poll_val = val;
+}
+
+// poll the target until it's done with a write, STK_FAILED if it never is
+uint8_t poll_ready() {
+  uint32_t start = millis();
+  while (param.polling ? (spi_transaction(0xF0, 0x00, 0x00, 0x00) & 0x01)
+                       : (spi_transaction(poll_cmd, poll_addr >> 8, poll_addr & 0xFF, 0x00) != poll_val)) {
+    serial_fill();
+    if (millis() - start > POLL_TIMEOUT) return STK_FAILED;
+  }
+  return STK_OK;
+}
+
+uint8_t wait_ready(uint8_t twd) {
+  uint8_t result = STK_OK;
+  PERF_START(t);
+  // keep taking serial input while we wait, a pipelined host is sending the next page
+  if (timed_writes || !(param.polling || (param.selftimed && poll_cmd))) {
+    uint32_t start = micros();
+    while (micros() - start < twd * 1000UL) serial_fill();
+  } else {
+#ifdef GANG_PROGRAMMING
+    result = gang_wait_ready();
+#else
+    result = poll_ready();
+#endif
+  }
+  poll_cmd = 0;
+  PERF_END(target_us, t);
+  return result;
+}
+
+void reply(uint8_t result) {
 //  if (EOP_SEEN == true) {
   if (CRC_EOP == getch()) {  // EOP should be next char
     Serial.write(STK_INSYNC);
-    Serial.write(STK_OK);
+    Serial.write(result);
+    if (result != STK_OK) error++;
   }
   else {
 //    pulse(LED_ERR, 2);
     error++;
-    Serial.write(STK_NOSYNC);
+    reply_nosync();
   }
 }
 
+// the frame didn't end where it should have
+void reply_nosync() {
+  PERF_COUNT(nosync);
+  baud_lost++;
+  Serial.write(STK_NOSYNC);
+}
+
+void replyOK() {
+  reply(STK_OK);
+}
+
 void breply(uint8_t b) {
   if (CRC_EOP == getch()) {  // EOP should be next char
     Serial.write(STK_INSYNC);
@@ -200,10 +492,67 @@ void breply(uint8_t b) {
   }
   else {
     error++;
-    Serial.write(STK_NOSYNC);
+    reply_nosync();
   }
 }
 
+// .kbv clock for chips which are not on an Arduino board.  Timer2 toggles OC2B in CTC mode, so
+// CLOCK_OUT runs at F_CPU/2/(OCR2A+1) -- 8, 4, 2 or 1MHz on a 16MHz UNO, rounded up to the
+// next of those for anything in between, and 0 turns it off.  ISP SCK has to stay under a
+// quarter of the target's clock, so a faster clock lets start_pmode() pick a faster SPI rate.
+uint8_t clock_mhz;
+
+void target_clock(uint8_t mhz) {
+  if (mhz) {
+    if (mhz > F_CPU/2/1000000) mhz = F_CPU/2/1000000;
+    OCR2A = F_CPU/2/1000000/mhz - 1;        // CTC toggle @ mhz
+    OCR2B = OCR2A;                          // match B
+    TCNT2 = 0;
+    TCCR2A = (1 << COM2B0) | (1 << WGM21);  // Toggle OC2B in CTC mode
+    TCCR2B = (1 << CS20);                   // run timer2 at div1
+    clock_mhz = F_CPU/2/1000000/(OCR2A + 1);
+  } else {
+    TCCR2A = 0;                             // timer off, back to a plain output held low
+    TCCR2B = 0;
+    FastPin<CLOCK_OUT>::low();
+    clock_mhz = 0;
+  }
+}
+
+// Serial rate.  We come up at ISP_BAUD (see ASM_ISP.h).  A host that knows to can ask for one of
+// these with STK_SET_PARAMETER 0xA3, and both ends switch once the reply has gone out at the old
+// rate.  STK_PMODE_END goes back to ISP_BAUD after its reply, so whatever runs next finds us where
+// it expects.  These are the rates a 16MHz UNO gets within about 2% of.
+//
+// A host that switched and then went away without STK_PMODE_END (killed, crashed, a verify that
+// gave up) would leave us at its rate, where the next avrdude can't get in sync.  So we also go
+// back to ISP_BAUD after BAUD_LOST replies in a row that made no sense of what came in, or after
+// BAUD_IDLE ms of silence both ways, and throw away whatever half frame arrived at the wrong rate.
+#define BAUD_LOST 4
+#define BAUD_IDLE 5000
+const uint32_t isp_bauds[] PROGMEM = { ISP_BAUD, 19200, 38400, 57600, 115200, 250000, 500000, 1000000 };
+uint8_t baud_code = 0;  // index into isp_bauds[]
+
+void set_baud(uint8_t code) {
+  Serial.flush();  // wait for the reply to finish at the old rate
+  Serial.begin(pgm_read_dword(&isp_bauds[code]));
+  baud_code = code;
+}
+
+void baud_fallback() {
+  set_baud(0);
+  while (Serial.available() > 0) Serial.read();
+  iBuffer = pBuffer = frame_start;
+  frame_n = frame_len = 0;
+  EOP_SEEN = false;
+  baud_lost = 0;
+}
+
+// SCK period in STK500 units (8 cycles of its 7.3728MHz crystal, ~1.085us) for a given rate
+uint8_t sck_duration(uint8_t rate) {
+  return ((uint32_t)(128 >> rate) * 921600UL + F_CPU / 2) / F_CPU;
+}
+
 void get_parameter(uint8_t c) {
   switch (c) {
     case 0x80:
@@ -215,76 +564,284 @@ void get_parameter(uint8_t c) {
     case 0x82:
       breply(SWMIN);
       break;
+    case 0x89:
+      breply(sck_duration(spi_rate)); // Parm_STK_SCK_DURATION
+      break;
     case 0x93:
       breply('S'); // serial programmer
       break;
+    case 0xA0:
+      breply(128 >> spi_rate); // SPI clock divider in use
+      break;
+    case 0xA1:
+      breply(clock_mhz);       // CLOCK_OUT frequency in MHz
+      break;
+    case 0xA2:
+      breply(pipeline);        // pipelined flash writes on/off
+      break;
+    case 0xA3:
+      breply(baud_code);       // serial rate, index into isp_bauds[]
+      break;
+    case 0xA4:
+      breply(delta);           // delta flash writes on/off
+      break;
+#ifdef GANG_PROGRAMMING
+    case 0xA5:
+      breply(gang_mask);       // gang targets to program, bit 0 is GANG_RESETS[0]
+      break;
+    case 0xA6:
+      breply(gang_failed);     // gang targets that dropped out of this session
+      break;
+#endif
     default:
       breply(0);
   }
 }
 
+void set_parameter(uint8_t c) {
+  uint8_t v = getch();
+  uint8_t result = STK_OK;
+  switch (c) {
+    case 0x89: // Parm_STK_SCK_DURATION -- the fastest rate with at least this period
+      spi_limit = sizeof(spi_dividers) - 1;
+      while (spi_limit > 0 && sck_duration(spi_limit) < v) spi_limit--;
+      break;
+    case 0xA1: // CLOCK_OUT frequency in MHz
+      target_clock(v);
+      break;
+    case 0xA2: // pipelined flash writes on/off
+      pipeline = v;
+      break;
+    case 0xA3: // serial rate, switched after the reply
+      if (v >= sizeof(isp_bauds) / sizeof(isp_bauds[0])) result = STK_FAILED;
+      break;
+    case 0xA4: // delta flash writes on/off
+      delta = v;
+      break;
+#ifdef GANG_PROGRAMMING
+    case 0xA5: // gang targets to program, from the next STK_PMODE_START
+      gang_mask = v & ((1 << GANG_SIZE) - 1);
+      if (!gang_mask) result = STK_FAILED;
+      break;
+#endif
+  }
+  reply(result);
+  if (c == 0xA3 && result == STK_OK) set_baud(v);
+}
+
 void set_parameters() {
-  // call this after reading paramter packet into buff[]
-  param.devicecode = buff[0];
-  param.revision   = buff[1];
-  param.progtype   = buff[2];
-  param.parmode    = buff[3];
-  param.polling    = buff[4];
-  param.selftimed  = buff[5];
-  param.lockbytes  = buff[6];
-  param.fusebytes  = buff[7];
-  param.flashpoll  = buff[8];
-  // ignore buff[9] (= buff[8])
+  // read straight out of the receive ring, in the order the host sends them
+  param.devicecode = getch();
+  param.revision   = getch();
+  param.progtype   = getch();
+  param.parmode    = getch();
+  param.polling    = getch();
+  param.selftimed  = getch();
+  param.lockbytes  = getch();
+  param.fusebytes  = getch();
+  param.flashpoll  = getch();
+  getch();  // ignore the second flashpoll byte (= the first)
   // following are 16 bits (big endian)
-  param.eeprompoll = beget16(&buff[10]);
-  param.pagesize   = beget16(&buff[12]);
-  param.eepromsize = beget16(&buff[14]);
+  param.eeprompoll = getch16();
+  param.pagesize   = getch16();
+  param.eepromsize = getch16();
 
   // 32 bits flashsize (big endian)
-  param.flashsize = buff[16] * 0x01000000
-                    + buff[17] * 0x00010000
-                    + buff[18] * 0x00000100
-                    + buff[19];
+  param.flashsize  = (uint32_t)getch16() << 16;
+  param.flashsize += getch16();
 
 }
 
-void start_pmode() {
+void set_ext_parameters() {
+  // first byte is the command size (itself plus the parameters), then the EEPROM page size,
+  // pagel, bs2 and reset disable -- the last three are parallel only
+  uint8_t n = getch();
+  param.eeprompage = (n > 1) ? getch() : 0;
+  while (n-- > 2) getch();
+}
+
+// Programming Enable, true if the target echoed 0x53 back on the third byte (in sync)
+uint8_t program_enable() {
+  PERF_SPI(4);
+  SPI.transfer(0xAC);
+  SPI.transfer(0x53);
+  uint8_t echo = SPI.transfer(0x00);
+  SPI.transfer(0x00);
+  return echo == 0x53;
+}
+
+uint8_t enter_pmode() {
+#ifdef GANG_PROGRAMMING
+  return gang_enter_pmode();
+#else
+  for (uint8_t attempt = 0; attempt < PMODE_ATTEMPTS; attempt++) {
+    // ensure SCK low then pulse reset, and wait at least 20 mS before enabling
+    FastPin<SCK>::low();
+    FastPin<RESET>::high();
+    delay(1);
+    FastPin<RESET>::low();
+    delay(20);
+    if (program_enable()) return 1;
+  }
+  return 0;
+#endif
+}
+
+void read_sig(uint8_t *sig) {
+  for (uint8_t i = 0; i < 3; i++) sig[i] = spi_transaction(0x30, 0x00, i, 0x00);
+}
+
+uint8_t read_cal() {
+  return spi_transaction(0x38, 0x00, 0x00, 0x00);
+}
+
+// true if the target reads back the same signature and calibration byte SPI_PROBES times over at
+// the rate just set, and still echoes the programming enable after
+uint8_t spi_rate_ok(const uint8_t *sig, uint8_t cal) {
+  uint8_t check[3];
+  for (uint8_t i = 0; i < SPI_PROBES; i++) {
+    read_sig(check);
+    if (memcmp(sig, check, 3) != 0 || read_cal() != cal) return 0;
+  }
+  return program_enable();
+}
+
+// true if the target answered the programming enable
+uint8_t start_pmode() {
   preSPI_DDRB = DDRB ; preSPI_PORTB = PORTB ;
   SPI.begin() ;
-  digitalWrite(RESET, HIGH) ;
-  pinMode(RESET, OUTPUT) ;
-  pinMode(SCK, OUTPUT) ;
-  delay(20);
-  digitalWrite(RESET, LOW);
-  spi_transaction(0xAC, 0x53, 0x00, 0x00);
+  pipe_result = STK_OK;
+  erased = 0;
+  pages_written = pages_skipped = 0;
+  spi_rate = 0;
+  SPI.setClockDivider(spi_dividers[spi_rate]);
+  FastPin<RESET>::high();
+  FastPin<RESET>::output();
+  FastPin<SCK>::output();
+
+  uint8_t sig[3] = { 0, 0, 0 };
+  uint8_t enabled = enter_pmode();
+  if (enabled) {
+    read_sig(sig);
+    if (sig[0] != 0x00 && sig[0] != 0xFF) {  // someone's there, find out how fast they can go
+      uint8_t cal = read_cal(), edge = 0;
+      while (spi_rate < spi_limit) {
+        SPI.setClockDivider(spi_dividers[spi_rate + 1]);
+        if (!spi_rate_ok(sig, cal)) {
+          edge = 1;
+          break;
+        }
+        spi_rate++;
+      }
+      // back off from the fastest rate that passed, unless the host's cap stopped us short of it
+      if (spi_rate > 0 && (edge || spi_limit == sizeof(spi_dividers) - 1)) spi_rate--;
+      SPI.setClockDivider(spi_dividers[spi_rate]);
+      if (edge) enter_pmode();  // the target may be out of step after the rate that failed
+    }
+#ifdef GANG_PROGRAMMING
+    gang_check_sig(sig);  // that was all on the lead, the rest have to match it at this rate
+#endif
+  }
   pmode = 1;
+  _addr = 0; ext_addr = 0;
+
+#ifndef STRIP_ABD
+  // some parts can't be polled for write completion, ABD knows which
+  timed_writes = needsTimedWrites(sig);
+#endif
+  return enabled;
 }
 
 void end_pmode() {
   SPI.end();
-  digitalWrite(RESET, HIGH);
-  pinMode(RESET, INPUT);
+  FastPin<RESET>::high();
+  FastPin<RESET>::input();
+#ifdef GANG_PROGRAMMING
+  gang_release();
+#endif
+  serial_next();
   pmode = 0;
-  DDRB = preSPI_DDRB ; PORTB = preSPI_PORTB ;
+  // just the SPI pins (SS, MOSI, MISO, SCK) -- LED_ERR is on PORTB too, and the scheduler owns it.
+  // With interrupts off, so a tick can't write LED_ERR between our read of PORTB and our write.
+  const uint8_t spi_pins = _BV(2) | _BV(3) | _BV(4) | _BV(5);
+  noInterrupts();
+  DDRB  = (DDRB  & ~spi_pins) | (preSPI_DDRB  & spi_pins);
+  PORTB = (PORTB & ~spi_pins) | (preSPI_PORTB & spi_pins);
+  interrupts();
+}
+
+// one STK_UNIVERSAL instruction out of the ring, keeping track of what it changes
+uint8_t universal_next() {
+  uint8_t ch, cmd[4];
+  for(uint8_t x = 0; x < 4; x++) cmd[x] = getch(); //**
+  ch = spi_transaction(cmd[0], cmd[1], cmd[2], cmd[3]);
+  if (cmd[0] == 0xAC && cmd[1] == 0x80) erased = 1;  // Chip Erase
+  if (cmd[0] == 0x4D) {  // Load Extended Address, keep track of it for STK_SET_ADDR
+    ext_addr = cmd[2];
+    _addr = (_addr & 0xFFFF) | ((uint32_t)ext_addr << 16);
+  }
+  return ch;
 }
 
 void universal() {
-  uint8_t ch;
-  readbytes(4);
-  ch = spi_transaction(buff[0], buff[1], buff[2], buff[3]);
-  breply(ch);
+  breply(universal_next());
+}
+
+// STK_UNIVERSAL_BATCH runs a count of STK_UNIVERSAL instructions from one frame and answers with
+// the byte each one returned, so reading or writing all the fuses, lock bits, signature and
+// calibration takes one exchange instead of a dozen.  avrdude waits out writes after each
+// STK_UNIVERSAL itself; here nobody else can, so every instruction that starts a write is waited
+// out before the next one runs: a Chip Erase, a fuse or lock bits write (anything else starting
+// 0xAC), an EEPROM byte or page write (0xC0, 0xC2) and a flash page write (0x4C).
+#define UNIVERSAL_BATCH 32
+
+// how long the target can be busy after an instruction, 0 if it doesn't write anything
+uint8_t universal_twd(uint8_t op, uint8_t op2) {
+  if (op == 0xAC) return (op2 == 0x80) ? TWD_ERASE : (op2 == 0x53) ? 0 : TWD_FUSE;
+  if (op == 0xC0 || op == 0xC2) return TWD_EEPROM;
+  if (op == 0x4C) return TWD_FLASH;
+  return 0;
+}
+
+void universal_batch() {
+  uint8_t n = getch();
+  if (n > UNIVERSAL_BATCH || CRC_EOP != ring[ring_at(pBuffer, n * 4)]) {
+    error++;
+    reply_nosync();
+    return;
+  }
+  Serial.write(STK_INSYNC);
+  for(uint8_t x = 0; x < n; x++) { //**
+    uint8_t twd = universal_twd(ring[pBuffer], ring[ring_at(pBuffer, 1)]);
+    Serial.write(universal_next());
+    if (twd) wait_ready(twd);
+  }
+  getch();  // CRC_EOP
+  Serial.write(STK_OK);
+}
+
+// set the extended (most significant) address byte if necessary, as readFlash() in ABD.cpp does
+void load_ext_addr(uint32_t addr) {
+  uint8_t MSB = (addr >> 16) & 0xFF;
+  if (MSB != ext_addr) {
+    spi_transaction(0x4D, 0x00, MSB, 0x00);
+    ext_addr = MSB;
+  }
 }
 
 void flash(uint8_t hilo, uint32_t addr, uint8_t data) {
-  spi_transaction(0x40 + 8 * hilo, addr >> 8 & 0xFF, addr & 0xFF, data);
+  PERF_SPI(4);
+  isp_load_page(hilo, addr, data);
+  poll_on(0x20 + 8 * hilo, addr, data, param.flashpoll, param.flashpoll);
 }
-void commit(uint32_t addr) {
+uint8_t commit(uint32_t addr) {
+  // the lamp stays off for as long as the target is busy, which is flicker enough
   if (PROG_FLICKER) prog_lamp(LOW);
+  load_ext_addr(addr);
   spi_transaction(0x4C, (addr >> 8) & 0xFF, addr & 0xFF, 0);
-  if (PROG_FLICKER) {
-    delay(PTIME);
-    prog_lamp(HIGH);
-  }
+  uint8_t result = wait_ready(TWD_FLASH);
+  if (PROG_FLICKER) prog_lamp(HIGH);
+  return result;
 }
 
 //#define _current_page(x) (_addr & 0xFFFFE0)
@@ -296,6 +853,89 @@ uint32_t current_page(uint32_t addr) { //**
   return addr;
 }
 
+// STK_PROG_PACKED sends a page PackBits compressed, which takes the 0xFF padding and constant
+// tables in most images down to a few bytes each.  A header byte h of 0 to 127 is followed by h+1
+// bytes to copy, -1 to -127 by one byte to repeat 1-h times, and -128 is ignored.  It's unpacked
+// as write_flash() and write_eeprom() take each byte, straight from the ring into the target's
+// page buffer, so it costs no RAM past the frame itself.  Delta writes don't apply to it.
+uint8_t unpacking = 0;
+typedef struct {
+  uint8_t run;    // bytes left in this run
+  uint8_t copy;   // copying them, else repeating value
+  uint8_t value;
+} unpack_state;
+unpack_state pack;
+#ifdef GANG_PROGRAMMING
+uint16_t     page_from;  // where the page gang_differs() reads back starts in the ring
+unpack_state pack_from;
+#endif
+
+// unpacked length of the n packed bytes at the front of the ring, 0 if they don't unpack cleanly
+uint16_t unpacked_length(uint16_t n) { //**
+  uint16_t at = 0, length = 0; //**
+  while (at < n) {
+    int8_t h = ring[ring_at(pBuffer, at)];
+    if (h >= 0) {
+      length += h + 1;
+      at += h + 2;
+    } else if (h != -128) {
+      length += 1 - h;
+      at += 2;
+    } else {
+      at++;
+    }
+  }
+  return (at == n && length <= 256) ? length : 0;
+}
+
+// next byte of page data, from the ring as it is or unpacked
+uint8_t page_byte() {
+  if (!unpacking) return getch();
+  while (pack.run == 0) {
+    int8_t h = getch();
+    if (h >= 0) {
+      pack.run = h + 1;
+      pack.copy = 1;
+    } else if (h != -128) {
+      pack.run = 1 - h;
+      pack.copy = 0;
+      pack.value = getch();
+    }
+  }
+  pack.run--;
+  return pack.copy ? getch() : pack.value;
+}
+
+// delta writes: how do the n bytes waiting in the ring for word address addr compare with what's
+// on the target?  (On all of them, in gang mode.)  Without a chip erase, loading and committing a
+// page can only clear bits -- flash ends up holding old AND new -- so a page that needs a 0 turned
+// back into a 1 can't be written at all.
+#define PAGE_SAME    0
+#define PAGE_DIFFERS 1
+#define PAGE_STUCK   2   // needs an erase first
+
+uint8_t page_compare(uint32_t addr, uint16_t n) { //**
+#ifdef GANG_PROGRAMMING
+  if (!erased) {
+    uint8_t stuck, differ;
+    page_from = pBuffer;
+    pack_from = pack;
+    differ = gang_differs(addr, n, &stuck);
+    gang_drop(stuck);  // the rest can still have it
+    if (!gang_active) return PAGE_STUCK;
+    return (differ & gang_active) ? PAGE_DIFFERS : PAGE_SAME;
+  }
+#endif
+  uint8_t result = PAGE_SAME;
+  for(uint16_t x = 0; x < n; x++) { //**
+    uint8_t b = ring[ring_at(pBuffer, x)];
+    uint8_t was = erased ? 0xFF : flash_read(x & 1, addr + x / 2);
+    if (b & ~was) return erased ? PAGE_DIFFERS : PAGE_STUCK;
+    if (b != was) result = PAGE_DIFFERS;
+  }
+  return result;
+}
+
 uint8_t write_flash(uint16_t length) { //**
 // // This makes no sense because even if pagesize is an int (as it was in the
 // // original code), if I understand beget properly, no recognized page size would
@@ -305,39 +945,76 @@ uint8_t write_flash(uint16_t length) { //**
 //    return STK_FAILED;
 //  }
   //if (param.pagesize != 64) return STK_FAILED; // legacy holdover?
-  if (param.pagesize > 128) { //**
+  if (param.pagesize > 256) { //**
     return STK_FAILED;
   }
-  uint32_t page = current_page(_addr); //**
+  // work from a copy, a pipelined host can send the next STK_SET_ADDR before we're done
+  uint32_t addr = _addr; //**
+  _addr += (length + 1) / 2;
   uint16_t x = 0; //**
   while (x < length) {
-    if (page != current_page(_addr)) {
-      commit(page);
-      page = current_page(_addr);
+    // as much of the data as falls in this page -- a word at a time if the page size isn't one
+    // current_page() knows
+    uint32_t page = current_page(addr); //**
+    uint16_t n = (current_page(addr + 1) == addr + 1) ? 2 : (page + param.pagesize / 2 - addr) * 2; //**
+    if (n > length - x) n = length - x;
+    uint8_t state = (delta && !unpacking) ? page_compare(addr, n) : PAGE_DIFFERS;
+    if (state == PAGE_STUCK) return STK_FAILED;
+    if (state == PAGE_SAME) {
+      pBuffer = ring_at(pBuffer, n);
+      pages_skipped++;
+    } else {
+#ifdef GANG_PROGRAMMING
+      page_from = pBuffer;
+      pack_from = pack;
+#endif
+      for(uint16_t y = 0; y < n; y += 2) { //**
+        flash(LOW, addr + y / 2, page_byte());
+        flash(HIGH, addr + y / 2, page_byte());
+        serial_fill();
+      }
+      if (page_commit) {
+        if (commit(page) != STK_OK) return STK_FAILED;
+#ifdef GANG_PROGRAMMING
+        // read it back from every target, and carry on with the ones that got it
+        gang_drop(gang_differs(addr, n, NULL));
+        if (!gang_active) return STK_FAILED;
+#endif
+        pages_written++;
+      }
     }
-    flash(LOW, _addr, buff[x++]);
-    flash(HIGH, _addr, buff[x++]);
-    _addr++;
+    x += n;
+    addr += n / 2;
   }
-  commit(page);
   return STK_OK;
 }
 
-uint8_t write_eeprom(uint8_t length) { //**
-  // _addr is a word address, so we use _addr*2
-  // this writes byte-by-byte,
-  // page writing may be faster (4 bytes at a time)
+uint8_t write_eeprom(uint16_t addr, uint16_t length) { //**
+  // addr is a byte address -- STK_PROG_PAGE's _addr is a word address, so it passes _addr*2
+  // if the host gave us an EEPROM page size, load each page (0xC1) and write it once (0xC2),
+  // otherwise write byte-by-byte (0xC0), waiting on every write to complete
+  uint8_t result = STK_OK;
   prog_lamp(LOW);
-  for(uint8_t x = 0; x < length; x++) { //**
-    uint32_t addr = _addr * 2 + x ;
-    spi_transaction(0xC0, (addr >> 8) & 0xFF, addr & 0xFF, buff[x]);
-    delay(45);
+  for(uint16_t x = 0; x < length && result == STK_OK; x++, addr++) { //**
+    uint8_t data = serial_patch(addr, page_byte());
+    if (param.eeprompage > 1) {
+      spi_transaction(0xC1, 0x00, addr & 0xFF, data);
+      poll_on(0xA0, addr, data, param.eeprompoll >> 8, param.eeprompoll & 0xFF);
+      if (page_commit && ((addr + 1) % param.eeprompage == 0 || x + 1 == length)) {
+        spi_transaction(0xC2, (addr >> 8) & 0xFF, addr & 0xFF, 0x00);
+        result = wait_ready(TWD_EEPROM);
+      }
+    } else {
+      spi_transaction(0xC0, (addr >> 8) & 0xFF, addr & 0xFF, data);
+      poll_on(0xA0, addr, data, param.eeprompoll >> 8, param.eeprompoll & 0xFF);
+      result = wait_ready(TWD_EEPROM);
+    }
   }
   prog_lamp(HIGH);
-  return STK_OK;
+  return result;
 }
 
-void program_page() {
+void program_page(uint8_t packed) {
   uint8_t result = STK_FAILED;
   uint16_t length = 256 * getch(); //**
   length += getch();
@@ -347,43 +1024,150 @@ void program_page() {
       return;
   }
   char memtype = (char)getch();
-  readbytes(length);
-  if (CRC_EOP == getch()) {
+  // the data gets written straight out of the ring, so check the frame is whole before starting
+  uint16_t eop = ring_at(pBuffer, length);
+  if (CRC_EOP == ring[eop]) {
     Serial.write(STK_INSYNC);
-    if (memtype == 'F') result = write_flash(length);
-    if (memtype == 'E') result = write_eeprom(length);
+    // from here on length is how much there is to write
+    if (packed) length = unpacked_length(length);
+    if (packed && memtype == 'F' && (length & 1)) length = 0;  // flash is written in whole words
+    unpacking = packed;
+    pack.run = 0;
+    if (packed && length == 0) {
+      // it didn't unpack, fail it rather than write something wrong
+    } else if (memtype == 'F' && pipeline) {
+      // answer for the page before this one, then write this one while the host sends the next
+      result = pipe_result;
+      pipe_result = STK_OK;
+      Serial.write(result);
+      if (result == STK_OK) {
+        writing = 1;
+        pipe_result = write_flash(length);
+        writing = 0;
+      } else {
+        error++;
+        reply_nosync();
+      }
+      unpacking = 0;
+      pBuffer = ring_next(eop);
+      return;
+    } else {
+      if (memtype == 'F') result = write_flash(length);
+      if (memtype == 'E') result = write_eeprom(_addr * 2, length);
+    }
+    unpacking = 0;
+    pBuffer = ring_next(eop);  // past whatever a failed write left unread
     Serial.write(result);
     if (result != STK_OK) {
       error++;
-      Serial.write(STK_NOSYNC);
+      reply_nosync();
     }
   }
   else {
     error++;
-    Serial.write(STK_NOSYNC);
+    reply_nosync();
   }
 }
 
-uint8_t flash_read(uint8_t hilo, uint16_t addr) {
-  return spi_transaction(0x20 + hilo * 8, (addr >> 8) & 0xFF, addr & 0xFF, 0);
+// STK_PAGE_COUNTS returns how many flash pages the last session wrote and how many delta writes
+// skipped, 16 bits each, big endian
+void page_counts() {
+  if (CRC_EOP != getch()) {
+    error++;
+    reply_nosync();
+    return;
+  }
+  Serial.write(STK_INSYNC);
+  Serial.write(pages_written >> 8);
+  Serial.write(pages_written & 0xFF);
+  Serial.write(pages_skipped >> 8);
+  Serial.write(pages_skipped & 0xFF);
+  Serial.write(STK_OK);
+}
+
+#ifdef PERF_COUNTERS
+void perf_command(uint8_t cmd) {
+  uint8_t x = 0;
+  while (x < PERF_COMMANDS && pgm_read_byte(&perf_commands[x]) != cmd) x++;
+  perf.commands[x]++;
+}
+
+// STK_PERF_GET returns the counters, big endian: the four times in microseconds, SPI bytes and
+// their time on the wire at this session's SPI rate (32 bit each), then NOSYNC and UNKNOWN
+// replies, getch() underruns and the ring's high water mark (16 bit each), then a count of
+// commands and that many command, count (16 bit) pairs, 0x00 for anything not in
+// perf_commands[].
+void perf_write(uint32_t v, uint8_t bytes) { //**
+  while (bytes--) Serial.write((v >> (8 * bytes)) & 0xFF);
 }
 
-char flash_read_page(uint16_t length) {
-  for(uint16_t x = 0; x < length; x+=2) {
-    uint8_t low = flash_read(LOW, _addr);
-    Serial.write(low);
-    uint8_t high = flash_read(HIGH, _addr);
-    Serial.write(high);
-    _addr++;
+void perf_get() {
+  if (CRC_EOP != getch()) {
+    error++;
+    reply_nosync();
+    return;
   }
-  return STK_OK;
+  Serial.write(STK_INSYNC);
+  perf_write(perf.wait_us, 4);
+  perf_write(perf.tx_us, 4);
+  perf_write(perf.cmd_us, 4);
+  perf_write(perf.target_us, 4);
+  perf_write(perf.spi_bytes, 4);
+  // 8 SCK cycles a byte at 128 >> spi_rate CPU cycles each -- divide last, a byte can take less
+  // than a microsecond
+  perf_write(perf.spi_bytes * 8 * (128 >> spi_rate) / (F_CPU / 1000000L), 4);
+  perf_write(perf.nosync, 2);
+  perf_write(perf.unknown, 2);
+  perf_write(perf.underruns, 2);
+  perf_write(perf.ring_max, 2);
+  Serial.write(PERF_COMMANDS + 1);
+  for(uint8_t x = 0; x <= PERF_COMMANDS; x++) { //**
+    Serial.write(x < PERF_COMMANDS ? pgm_read_byte(&perf_commands[x]) : 0x00);
+    perf_write(perf.commands[x], 2);
+  }
+  Serial.write(STK_OK);
 }
+#endif /* PERF_COUNTERS */
 
-char eeprom_read_page(uint16_t length) { //**
-  // _addr again we have a word address
-  for(uint16_t x = 0; x < length; x++) { //**
-    uint8_t ee = spi_transaction(0xA0, 0x00, _addr * 2 + x, 0xFF);
-    Serial.write(ee);
+uint8_t flash_read(uint8_t hilo, uint32_t addr) {
+  load_ext_addr(addr);
+  PERF_SPI(4);
+  return isp_read_flash(hilo, addr);
+}
+
+// STK_READ_PAGE reads ahead of the UART: target bytes go into the ring, in the space the next
+// frame would use (nothing arrives while the host waits on a read), and are handed to Serial only
+// as its transmit buffer has room.  HardwareSerial's interrupt sends them while we carry on
+// reading, so SPI never stalls on a full transmit buffer and the UART has up to a page queued.
+// addr is a byte address here, for flash too.  What's sent is also folded into tx_sum, for
+// STK500v2's checksum.
+#define READ_AHEAD 256
+uint8_t tx_sum = 0;
+
+uint8_t read_byte(char memtype, uint32_t addr) { //**
+  if (memtype == 'F') return flash_read(addr & 1, addr >> 1);
+  PERF_SPI(4);
+  return isp_read_eeprom(addr);
+}
+
+uint8_t read_ahead(char memtype, uint32_t addr, uint16_t length) { //**
+  uint16_t got = 0, sent = 0; //**
+  while (sent < length) {
+    if (got < length && got - sent < READ_AHEAD) {
+      ring[ring_at(iBuffer, got % READ_AHEAD)] = read_byte(memtype, addr + got);
+      got++;
+    } else {
+      // nothing left to read ahead, only the UART can move us on
+      PERF_START(t);
+      while (Serial.availableForWrite() == 0);
+      PERF_END(tx_us, t);
+    }
+    while (sent < got && Serial.availableForWrite() > 0) {
+      uint8_t b = ring[ring_at(iBuffer, sent % READ_AHEAD)];
+      tx_sum ^= b;
+      Serial.write(b);
+      sent++;
+    }
   }
   return STK_OK;
 }
@@ -395,20 +1179,129 @@ void read_page() {
   char memtype = getch();
   if (CRC_EOP != getch()) {
 //    error++; ?? in original and SPI version, but not others... Do we really want the light on for this?
-    Serial.write(STK_NOSYNC);
+    reply_nosync();
     return;
   }
   Serial.write(STK_INSYNC);
-  if (memtype == 'F') result = flash_read_page(length);
-  if (memtype == 'E') result = eeprom_read_page(length);
+  // _addr is a word address, for EEPROM too
+  if (memtype == 'F' || memtype == 'E') result = read_ahead(memtype, _addr * 2, length);
+  if (memtype == 'F') _addr += (length + 1) / 2;
   Serial.write(result);
   return;
 }
 
+// STK_VERIFY_PAGE takes a page framed just like STK_PROG_PAGE and compares it with the target
+// instead of writing it, moving _addr on the same way.  The reply is only ever STK_OK, so the data
+// only goes one way, half the traffic of reading the image back.  Each page gets a bit in
+// verify_map, in the order they were sent, set if it didn't match; STK_VERIFY_RESULT returns the
+// number of pages (16 bits, big endian) and the map, lowest bit first, and starts a new one.
+#define VERIFY_PAGES 1024  // 256K of flash in 256 byte pages
+uint8_t  verify_map[VERIFY_PAGES / 8];
+uint16_t verify_pages = 0;
+
+void verify_page() {
+  uint16_t length = getch16();
+  char memtype = getch();
+  if (length > 256 || CRC_EOP != ring[ring_at(pBuffer, length)]) {
+    error++;
+    reply_nosync();
+    return;
+  }
+  uint16_t eop = ring_at(pBuffer, length);
+  // _addr is a word address, for EEPROM too
+  uint32_t addr = _addr * 2; //**
+  uint8_t differ = (memtype != 'F' && memtype != 'E');
+  for(uint16_t x = 0; x < length && !differ; x++) { //**
+    if (read_byte(memtype, addr + x) != getch()) differ = 1;
+  }
+  if (memtype == 'F') _addr += (length + 1) / 2;
+  pBuffer = ring_next(eop);  // past whatever a mismatch left unread
+  if (verify_pages < VERIFY_PAGES) {
+    if (differ) verify_map[verify_pages / 8] |= 1 << (verify_pages % 8);
+    verify_pages++;
+  }
+  Serial.write(STK_INSYNC);
+  Serial.write(STK_OK);
+}
+
+void verify_result() {
+  if (CRC_EOP != getch()) {
+    error++;
+    reply_nosync();
+    return;
+  }
+  Serial.write(STK_INSYNC);
+  Serial.write(verify_pages >> 8);
+  Serial.write(verify_pages & 0xFF);
+  Serial.write(verify_map, (verify_pages + 7) / 8);
+  Serial.write(STK_OK);
+  memset(verify_map, 0, sizeof(verify_map));
+  verify_pages = 0;
+}
+
+// STK_CHECKSUM digests a flash or EEPROM range here, so a host can verify an image or blank-check
+// a part from a few bytes of reply rather than reading it all back.  Arguments are the memory type
+// ('F' or 'E'), the digest (0 CRC32, as zlib computes it, or 1 MD5), then a 32 bit byte address
+// and length, big endian.  The reply is 1 if every byte in the range was 0xFF (0 if not), then the
+// digest -- 4 bytes, big endian, or 16.
+const uint32_t crc32_nibble[16] PROGMEM = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+uint32_t crc32_update(uint32_t crc, uint8_t b) { //**
+  crc = (crc >> 4) ^ pgm_read_dword(&crc32_nibble[(crc ^ b) & 0x0F]);
+  return (crc >> 4) ^ pgm_read_dword(&crc32_nibble[(crc ^ (b >> 4)) & 0x0F]);
+}
+
+void checksum() {
+  char memtype = getch();
+  uint8_t md5 = getch();
+  uint32_t addr = (uint32_t)getch16() << 16; //**
+  addr |= getch16();
+  uint32_t length = (uint32_t)getch16() << 16; //**
+  length |= getch16();
+  if (CRC_EOP != getch()) {
+    error++;
+    reply_nosync();
+    return;
+  }
+  Serial.write(STK_INSYNC);
+  if ((memtype != 'F' && memtype != 'E') || md5 > 1) {
+    error++;
+    Serial.write(STK_FAILED);
+    return;
+  }
+
+  md5_context ctx;
+  uint32_t crc = 0xFFFFFFFF; //**
+  uint8_t chunk[32], blank = 1;
+  if (md5) md5_starts(&ctx);
+  while (length > 0) {
+    uint8_t n = (length < sizeof(chunk)) ? length : sizeof(chunk);
+    for(uint8_t x = 0; x < n; x++) { //**
+      chunk[x] = read_byte(memtype, addr++);
+      if (chunk[x] != 0xFF) blank = 0;
+      if (!md5) crc = crc32_update(crc, chunk[x]);
+    }
+    if (md5) md5_update(&ctx, chunk, n);
+    length -= n;
+  }
+  Serial.write(blank);
+  if (md5) {
+    md5_finish(&ctx, chunk);
+    Serial.write(chunk, 16);
+  } else {
+    crc = ~crc;
+    for(int8_t x = 24; x >= 0; x -= 8) Serial.write((uint8_t)(crc >> x)); //**
+  }
+  Serial.write(STK_OK);
+}
+
 void read_signature() {
   if (CRC_EOP != getch()) {
     error++;
-    Serial.write(STK_NOSYNC);
+    reply_nosync();
     return;
   }
   Serial.write(STK_INSYNC);
@@ -421,28 +1314,40 @@ void read_signature() {
   Serial.write(STK_OK);
 }
 
+// a tone with a period of tone us for duration ms, after whatever's already queued -- tone 0 is
+// a rest
 void beep(uint16_t tone, uint16_t duration){ //**
-  uint16_t elapsed = 0; //**
-  while (elapsed < (duration * 10000)) {
-    digitalWrite(PIEZO, HIGH);
-    delayMicroseconds(tone / 2);
-    digitalWrite(PIEZO, LOW);
-    delayMicroseconds(tone / 2);
-    // Keep track of how long we pulsed
-    elapsed += tone;
-  }
+  if (notes == NOTES || duration == 0) return;
+  noInterrupts();
+  uint8_t n = (note_first + notes) % NOTES;
+  note_half[n] = (tone + 1000000 / SCHED_HZ) / (2 * 1000000 / SCHED_HZ);  // rounded
+  note_ticks[n] = SCHED_TICKS(duration);
+  notes++;
+  interrupts();
 }
 
 ////////////////////////////////////
 ////////////////////////////////////
 
 void avrisp() {
-  uint8_t data, low, high;
   uint8_t avrch = getch();
 
+  // A pipelined page failed after its reply had gone.  Whatever the host sends next gets
+  // INSYNC FAILED in place of its answer, so a STK_SET_ADDR or STK_READ_PAGE for the verify, a
+  // STK_UNIVERSAL or a STK_GET_SYNC fails the session too -- pages and STK_PMODE_END carry it
+  // themselves.
+  if (pipe_result != STK_OK && avrch != STK_PROG_PAGE && avrch != STK_PROG_PACKED &&
+      avrch != STK_PMODE_END && avrch != CRC_EOP && avrch != STK2_START) {
+    pipe_result = STK_OK;
+    pBuffer = frame_eop();
+    reply(STK_FAILED);
+    return;
+  }
+
   switch (avrch) {
     case STK_GET_SYNC:
                             error = 0;
+                            PERF_RESET();
                             replyOK();
                             break;
     case STK_GET_SIGNON:
@@ -452,19 +1357,21 @@ void avrisp() {
                               Serial.write(STK_OK);
                             } else {
                               error++;
-                              Serial.write(STK_NOSYNC);
+                              reply_nosync();
                             }
                             break;
     case STK_GET_PARM:
                             get_parameter(getch());
                             break;
+    case STK_SET_PARAMETER:
+                            set_parameter(getch());
+                            break;
     case STK_SET_PARM:
-                            readbytes(20);
                             set_parameters();
                             replyOK();
                             break;
     case STK_SET_PARM_EXT:
-                            readbytes(5);
+                            set_ext_parameters();
                             replyOK();
                             break;
     case STK_PMODE_START:
@@ -480,10 +1387,13 @@ void avrisp() {
                             beep(1000, 50);
                             error = 0;
                             end_pmode();
-                            replyOK();
+                            reply(pipe_result);  // the last pipelined page may have failed
+                            pipe_result = STK_OK;
+                            if (baud_code) set_baud(0);
                             break;
     case STK_SET_ADDR:
-                            _addr = getch();
+                            _addr &= 0xFF0000;  // keep the extended address
+                            _addr += getch();
                             _addr += 256 * getch();
                             replyOK();
                             break;
@@ -491,17 +1401,17 @@ void avrisp() {
                             universal();
                             break;
     case STK_PROG_FLASH:
-                            low = getch();
-                            high = getch();
+                            getch();  // low
+                            getch();  // high
                             replyOK();
                             break;
     case STK_PROG_DATA:
-                            data = getch();
+                            getch();  // data
                             replyOK();
                             break;
     case STK_PROG_PAGE:
                             // beep(1912, 5);      // Until I can get better control of buzzer, it's too damn noisy
-                            program_page();
+                            program_page(0);
                             break;
     case STK_READ_PAGE:
                             read_page();
@@ -509,50 +1419,180 @@ void avrisp() {
     case STK_READ_SIGN:
                             read_signature();
                             break;
+    case STK_CHECKSUM:
+                            checksum();
+                            break;
+    case STK_VERIFY_PAGE:
+                            verify_page();
+                            break;
+    case STK_VERIFY_RESULT:
+                            verify_result();
+                            break;
+    case STK_PAGE_COUNTS:
+                            page_counts();
+                            break;
+    case STK_PROG_PACKED:
+                            program_page(1);
+                            break;
+    case STK_UNIVERSAL_BATCH:
+                            universal_batch();
+                            break;
+    case STK_SERIAL_SET:
+                            serial_set();
+                            break;
+    case STK_SERIAL_GET:
+                            serial_get();
+                            break;
+#ifdef PERF_COUNTERS
+    case STK_PERF_GET:
+                            perf_get();
+                            break;
+#endif /* PERF_COUNTERS */
+#ifdef STAMP_MODE
+    case STK_STAMP_ERASE:
+                            stamp_erase();
+                            break;
+    case STK_STAMP_WRITE:
+                            stamp_write();
+                            break;
+    case STK_STAMP_READ:
+                            stamp_read();
+                            break;
+    case STK_STAMP:
+                            stamp_command();
+                            break;
+#endif /* STAMP_MODE */
+#ifndef STRIP_STK500V2
+    case STK2_START:        // the whole STK500v2 message is framed, see STK500v2.ino
+                            stk500v2();
+                            break;
+#endif /* STRIP_STK500V2 */
 
     case CRC_EOP:   // expecting a command, not CRC_EOP -- get back in sync
                             error++;
-                            Serial.write(STK_NOSYNC);
+                            reply_nosync();
                             break;
     default:        // anything else we will return STK_UNKNOWN
                             error++;
-                            if (CRC_EOP == getch())
+                            PERF_COUNT(unknown);
+                            pBuffer = frame_eop();  // past any arguments frame_table[] gave it
+                            if (CRC_EOP == getch()) {
+                              baud_lost++;
                               Serial.write(STK_UNKNOWN);
-                            else
-                              Serial.write(STK_NOSYNC);
+                            } else
+                              reply_nosync();
   }
 }
 
 // Where real loop activities should go since getEOP is called from more than just loop()
 // and doesn't hang on Serial.available like previous ArduinoISP versions sometimes did.
 
-void getEOP() {
-  uint16_t minL = 0; //**
-  uint8_t  avrch = 0;
-  while (!EOP_SEEN) {
-    while (Serial.available()>0) {
-      uint8_t ch = Serial.read();
-      _buffer[iBuffer] = ch;
-      iBuffer = (++iBuffer)%256;  // increment and wrap
-      if (iBuffer == 1)  avrch = ch;  // save command
-      if ((avrch == STK_PROG_PAGE) && (iBuffer==3)) {
-        minL = 256*_buffer[1] + _buffer[2] + 4;
-      }
-      if ((iBuffer>minL) && (ch == CRC_EOP)) {
-        EOP_SEEN = true;
+// Take one byte of the incoming frame, working out its length as soon as enough has arrived
+// and flagging EOP_SEEN on the last one.  Whether that last byte really is a CRC_EOP is left to
+// the command handlers, which answer STK_NOSYNC if it isn't, as they always have.
+void frame_byte(uint8_t ch) {
+  ring[iBuffer] = ch;
+  iBuffer = ring_next(iBuffer);  // increment and wrap
+  frame_n++;
+  uint8_t cmd = ring[frame_start];
+  if (frame_n == 1) {
+    frame_len = 2;  // command and CRC_EOP
+    if (cmd == CRC_EOP) frame_len = 1;  // stray EOP, avrisp() answers STK_NOSYNC right away
+    for(uint8_t x = 0; x < sizeof(frame_table) / sizeof(frame_table[0]); x++) { //**
+      if (pgm_read_byte(&frame_table[x][0]) == cmd) {
+        uint8_t args = pgm_read_byte(&frame_table[x][1]);
+        frame_len = (args == FRAME_VAR) ? 0 : args + 2;
+        break;
       }
     }
+  } else if (frame_len == 0) {
+    if (cmd == STK_SET_PARM_EXT) frame_len = (ch ? ch : 1) + 2;
+    if (cmd == 0x57)             frame_len = ch + 4;
+    if (cmd == STK_STAMP_WRITE && frame_n == 6) {
+      uint16_t length = 256 * ring[ring_at(frame_start, 4)] + ch;
+      frame_len = (length > 256) ? 6 : length + 7;  // stamp_write() refuses more than 256
+    }
+    if (cmd == STK_UNIVERSAL_BATCH && frame_n == 2) {
+      // universal_batch() refuses more than UNIVERSAL_BATCH, stop here rather than wait for them
+      frame_len = (ch > UNIVERSAL_BATCH) ? 2 : ch * 4 + 3;
+    }
+    if ((cmd == STK_PROG_PAGE || cmd == STK_VERIFY_PAGE || cmd == STK_PROG_PACKED) && frame_n == 3) {
+      uint16_t length = 256 * ring[ring_at(frame_start, 1)] + ch;
+      // program_page() refuses anything bigger than a page after the header, don't wait for it
+      frame_len = (length > 256) ? 5 : length + 5;
+    }
+    if (cmd == STK2_START && frame_n == 4) {
+      uint16_t size = 256 * ring[ring_at(frame_start, 2)] + ch;
+      // stop after the token if it's too big to be real, stk500v2() answers the checksum error
+      frame_len = (size > STK2_MAX_BODY) ? 5 : size + 6;
+    }
+  }
+  if (frame_n == frame_len) EOP_SEEN = true;
+}
+
+// Move whatever has arrived into the ring, up to the end of the frame -- anything after that can
+// wait in the serial buffer.  Called while we wait on the target as well as from getEOP(), so a
+// pipelined host's next page is already in the ring by the time we're ready for it.
+void serial_fill() {
+#ifdef STAMP_MODE
+  if (stamping) return;  // the ring is full of image, see stamp_target()
+#endif
+  uint16_t was = iBuffer;
+  while (!EOP_SEEN && ring_next(iBuffer) != pBuffer && Serial.available()>0) {
+    frame_byte(Serial.read());
+  }
+  if (iBuffer != was) baud_heard = millis();
+#ifdef PERF_COUNTERS
+  uint16_t fill = ring_at(iBuffer, RING_SIZE - pBuffer);
+  if (fill > perf.ring_max) perf.ring_max = fill;
+#endif
+  // the host sends STK_SET_ADDR as soon as we've answered for a pipelined page and waits on the
+  // reply before sending the next one, so answer it now rather than after the write
+  if (EOP_SEEN && writing && ring[frame_start] == STK_SET_ADDR) dispatch();
+}
+
+// hand the frame that just arrived to avrisp(), and start receiving the next one after it
+void dispatch() {
+  uint16_t resume = pBuffer;
+  uint8_t lost = baud_lost;
+  pBuffer = frame_start;
+  frame_start = iBuffer;
+  frame_n = frame_len = 0;
+  EOP_SEEN = false;
+#ifdef PERF_COUNTERS
+  // an STK_SET_ADDR answered in the middle of a pipelined write is already in that write's time
+  uint8_t cmd = ring[pBuffer], nested = writing;
+  PERF_START(t);
+  avrisp();
+  if (!nested) PERF_END(cmd_us, t);
+  perf_command(cmd);
+#else
+  avrisp();
+#endif
+  pBuffer = writing ? resume : frame_start;  // back to the page if we cut in on one
+  baud_heard = millis();
+  if (baud_lost == lost) baud_lost = 0;  // that one made sense, the run is over
+  else if (baud_lost >= BAUD_LOST && baud_code && !writing) baud_fallback();
+}
+
+void getEOP() {
+  while (!EOP_SEEN) {
+    serial_fill();
 
     // Do loop stuff unless we have something to do -- that takes priority
     if (!EOP_SEEN) {
       // Real Loop stuff should go here
 
-      heartbeat(); //delay(10) ;            // light the heartbeat LED
-
 #ifndef STRIP_ABD
-      if (digitalRead(ABD_SELECTOR) == LOW && !pmode) { softwareReset(); }
+      if (FastPin<ABD_SELECTOR>::read() == LOW && !pmode) { softwareReset(); }
 #endif /* STRIP_ABD */
 
+#ifdef STAMP_MODE
+      if (FastPin<STAMP_BUTTON>::read() == LOW && !pmode && frame_n == 0) stamp();
+#endif /* STAMP_MODE */
+
+      if (baud_code && millis() - baud_heard > BAUD_IDLE) baud_fallback();
+
     }
   }
 }
@@ -570,52 +1610,55 @@ void setup() {
 
 // Set up pins
 
-  pinMode(LED_PMODE,    OUTPUT);
-  pinMode(LED_ERR,      OUTPUT);
-  pinMode(LED_HB,       OUTPUT);
-  pinMode(PIEZO,        OUTPUT);
+  FastPin<LED_PMODE>::output();
+  FastPin<LED_ERR>::output();
+  FastPin<LED_HB>::output();
+  FastPin<PIEZO>::output();
 
 #ifndef STRIP_ABD
-  pinMode(ABD_SELECTOR, INPUT_PULLUP);
+  FastPin<ABD_SELECTOR>::input_pullup();
 #endif
 
-  // .kbv these next statements provide a 1MHz clock signal on pin 3
+#ifdef STAMP_MODE
+  stamp_setup();
+#endif
+  serial_setup();
+
+  // .kbv these next statements provide a clock signal on pin 3
   // DDRD |= (1 << 3);                    // make pin 3 an output (equiv to DDRD = DDRD | B00001000)
-  pinMode(CLOCK_1MHZ, OUTPUT) ;           // same as above, but more portable, we don't care about timing yet, and don't have to worry about D versus B if CLOCK_1MHZ > 7)
+  FastPin<CLOCK_OUT>::output();           // same as above, but more portable, we don't care about timing yet, and don't have to worry about D versus B if CLOCK_OUT > 7)
 
 // End of pin setup
 
-  // .kbv part of 1MHz clock signal on pin 3
-  OCR2A = F_CPU/2/1000000 - 1;            // CTC toggle @ 1MHz
-  OCR2B = OCR2A;                          // match B
-  TCCR2A = (1 << COM2B0) | (1 << WGM21);  // Toggle OC2B in CTC mode
-  TCCR2B = (1 << CS20);                   // run timer2 at div1
+  target_clock(CLOCK_OUT_MHZ);            // .kbv part of clock signal on pin 3
 
 #ifndef STRIP_ABD
 
-  if (digitalRead(ABD_SELECTOR) == LOW) {
-    digitalWrite(LED_PMODE, HIGH) ;
-    digitalWrite(LED_ERR, HIGH) ;
-    digitalWrite(LED_HB, HIGH) ;
+  if (FastPin<ABD_SELECTOR>::read() == LOW) {
+    FastPin<LED_PMODE>::high();
+    FastPin<LED_ERR>::high();
+    FastPin<LED_HB>::high();
     detectBoard();
   } else {
 #endif /* STRIP_ABD */
 
 // No, it's time to be an ISP
 
-    Serial.begin(19200);
+    Serial.begin(ISP_BAUD);
     SPI.setDataMode(0);
     SPI.setBitOrder(MSBFIRST);
-    SPI.setClockDivider(SPI_CLOCK_DIV128); // Clock Div can be 2,4,8,16,32,64, or 128
+    SPI.setClockDivider(SPI_CLOCK_DIV128); // start_pmode() negotiates the rate per session
 
     EOP_SEEN = false;      // Defaults set in definition above -- do we need to reset them here?
-    iBuffer = pBuffer = 0; // Saves 20 bytes if we don't... need to see if this works across resets.
+    iBuffer = pBuffer = frame_start = 0; // Saves 20 bytes if we don't... need to see if this works across resets.
 
+    sched_start();
+    beep(1500, 10);
+    beep(0, 60);
     beep(1500, 10);
     pulse(LED_PMODE, 2, 20);
     pulse(LED_ERR, 2, 20);
     pulse(LED_HB, 2, 20);
-    beep(1500, 10);
 
 #ifndef STRIP_ABD
   }
@@ -626,16 +1669,15 @@ void setup() {
 // Loopy loopy
 
 void loop(void) {
-  digitalWrite(LED_PMODE, pmode ? HIGH : LOW) ; // is pmode active?
-  digitalWrite(LED_ERR,   error ? HIGH : LOW) ; // is there an error?
+  lamp = pmode;  // is pmode active?  LED_ERR shows whether there's an error by itself
 
+  PERF_START(t);
   getEOP();  // <-- Put loop stuff like Heartbeat, ABD_SELECTOR check, etc. in getEOP() above.
+  PERF_END(wait_us, t);
 
   // have we received a complete request?  (ends with CRC_EOP)
   if (EOP_SEEN) {
-    digitalWrite(LED_PMODE, HIGH);
-    EOP_SEEN = false;
-    avrisp();
-    iBuffer = pBuffer = 0;  // restart buffer
+    lamp = 1;
+    dispatch();
   }
 }
@@ -0,0 +1,52 @@
+#ifndef _FAST_PIN_H
+#define _FAST_PIN_H
+
+// Compile-time pins, shared by ASM_ISP.ino and ABD.cpp.
+//
+// digitalWrite(), digitalRead() and pinMode() look the pin's port and bit up in PROGMEM tables,
+// check whether a timer has to be taken off it and save and restore SREG, every call -- 50 to 70
+// cycles for what is a single sbi, cbi or sbis when the pin is a constant, as all of ours in
+// ASM_ISP.h are.  FastPin<pin> does the lookup at compile time, so on the ATmega328P and 168
+// (the UNO and its kin) each call is one or two instructions on PORTx, DDRx or PINx, and atomic.
+// For anything else it falls back to the Arduino calls, so the sketch still builds on a board
+// whose pin map isn't written down here.
+//
+// Unlike digitalWrite() it leaves any timer output on the pin alone, so it's not for a pin
+// analogWrite() or a compare output is driving -- LED_HB while the scheduler runs, CLOCK_OUT
+// while the clock is on.
+
+#include <Arduino.h>
+
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__) || defined(__AVR_ATmega168P__)
+
+template <uint8_t pin> struct FastPin {
+  static_assert(pin < 20, "FastPin only knows the UNO's pins, 0-13 and A0-A5");
+  static const uint8_t mask = _BV(pin < 8 ? pin : pin < 14 ? pin - 8 : pin - 14);
+  static inline volatile uint8_t &port() { return pin < 8 ? PORTD : pin < 14 ? PORTB : PORTC; }
+  static inline volatile uint8_t &ddr()  { return pin < 8 ? DDRD  : pin < 14 ? DDRB  : DDRC; }
+  static inline volatile uint8_t &in()   { return pin < 8 ? PIND  : pin < 14 ? PINB  : PINC; }
+
+  static inline void high() { port() |= mask; }
+  static inline void low()  { port() &= ~mask; }
+  static inline void write(uint8_t v) { if (v) high(); else low(); }
+  static inline uint8_t read() { return (in() & mask) ? HIGH : LOW; }
+  static inline void output() { ddr() |= mask; }
+  static inline void input()  { ddr() &= ~mask; low(); }
+  static inline void input_pullup() { ddr() &= ~mask; high(); }
+};
+
+#else
+
+template <uint8_t pin> struct FastPin {
+  static inline void high() { digitalWrite(pin, HIGH); }
+  static inline void low()  { digitalWrite(pin, LOW); }
+  static inline void write(uint8_t v) { digitalWrite(pin, v ? HIGH : LOW); }
+  static inline uint8_t read() { return digitalRead(pin); }
+  static inline void output() { pinMode(pin, OUTPUT); }
+  static inline void input()  { pinMode(pin, INPUT); }
+  static inline void input_pullup() { pinMode(pin, INPUT_PULLUP); }
+};
+
+#endif
+
+#endif /* _FAST_PIN_H */
@@ -0,0 +1,162 @@
+// Gang.ino -- programming several targets at once for ASM_ISP
+
+// Copyright 2015 Aaron Magill -- MIT LICENSE -- see LICENSE file for text of license
+
+// Everything we send goes to every target in gang_active: they're all held in reset on the same
+// MOSI and SCK, so page loads, commits, erases and fuse writes reach them all for the serial
+// traffic of one.  Only what comes back has to be taken a target at a time, by enabling that
+// target's MISO buffer with gang_select() -- polling for the end of each write, and reading each
+// flash page back to check it arrived.  A target that doesn't answer, stays busy or doesn't get
+// its page is dropped from the session and shows up in gang_failed, and the rest carry on; a
+// write only fails once there's nobody left.
+//
+// What the host reads (signature, STK_UNIVERSAL, STK_READ_PAGE, STK_CHECKSUM) comes from
+// gang_lead, the first target still in.  The SPI rate is negotiated on it too, and the others have
+// to read back the same signature at that rate to stay in.  EEPROM writes go to all of them but
+// aren't read back.
+//
+// Define GANG_PROGRAMMING in ASM_ISP.h to build it in.
+
+#ifdef GANG_PROGRAMMING
+
+// enable one target's MISO buffer, and only that one
+void gang_select(uint8_t t) {
+  for(uint8_t x = 0; x < GANG_SIZE; x++) digitalWrite(gang_selects[x], (x == t) ? LOW : HIGH); //**
+}
+
+void gang_select_lead() {
+  gang_lead = 0;
+  while (gang_lead < GANG_SIZE - 1 && !(gang_active & _BV(gang_lead))) gang_lead++;
+  gang_select(gang_lead);
+}
+
+// let them all go at the end of the session
+void gang_release() {
+  for(uint8_t x = 0; x < GANG_SIZE; x++) { //**
+    digitalWrite(gang_selects[x], HIGH);
+    digitalWrite(gang_resets[x], HIGH);
+    pinMode(gang_resets[x], INPUT);
+  }
+}
+
+// A target that has had a programming enable stays in programming mode for as long as RESET is
+// low, and goes on hearing every erase, page and fuse write on MOSI.  Bringing RESET high for a
+// moment takes it out, and low again keeps it from running -- with its MISO buffer off.
+void gang_hold(uint8_t targets) {
+  for(uint8_t x = 0; x < GANG_SIZE; x++) { //**
+    if (!(targets & _BV(x))) continue;
+    digitalWrite(gang_selects[x], HIGH);
+    digitalWrite(gang_resets[x], HIGH);
+    delayMicroseconds(10);
+    digitalWrite(gang_resets[x], LOW);
+  }
+}
+
+// take targets out of the session -- they stay held in reset, out of programming mode, until
+// gang_release() at end_pmode(), so a half written part doesn't start running (or drive the bus,
+// or take the rest's erases and writes) while the rest are programmed
+void gang_drop(uint8_t targets) {
+  targets &= gang_active;
+  if (!targets) return;
+  gang_hold(targets);
+  gang_active &= ~targets;
+  gang_failed |= targets;
+  error++;
+  gang_select_lead();
+}
+
+// enter_pmode() for the gang: pulse the resets and look for each target's programming enable
+// echo, pulsing again for the ones that don't answer
+uint8_t gang_enter_pmode() {
+  gang_active = 0;
+  for(uint8_t x = 0; x < GANG_SIZE; x++) pinMode(gang_selects[x], OUTPUT); //**
+  for (uint8_t attempt = 0; attempt < PMODE_ATTEMPTS && gang_active != gang_mask; attempt++) {
+    uint8_t retry = gang_mask & ~gang_active;
+    FastPin<SCK>::low();
+    for(uint8_t x = 0; x < GANG_SIZE; x++) { //**
+      if (retry & _BV(x)) {
+        digitalWrite(gang_resets[x], HIGH);
+        pinMode(gang_resets[x], OUTPUT);
+      }
+    }
+    delay(1);
+    for(uint8_t x = 0; x < GANG_SIZE; x++) { //**
+      if (retry & _BV(x)) digitalWrite(gang_resets[x], LOW);
+    }
+    delay(20);
+    // every target hears every programming enable, which does no harm to those already enabled
+    for(uint8_t x = 0; x < GANG_SIZE; x++) { //**
+      if (!(retry & _BV(x))) continue;
+      gang_select(x);
+      if (program_enable()) gang_active |= _BV(x);
+    }
+  }
+  // the ones that never answered are out, and stay in reset like anyone dropped later -- the
+  // enables sent for the others may have reached them since they were tried
+  gang_failed = gang_mask & ~gang_active;
+  if (gang_failed) error++;
+  gang_hold(gang_failed);
+  gang_select_lead();
+  return gang_active != 0;
+}
+
+// start_pmode() negotiated the SPI rate with the lead, drop anyone who can't keep up or isn't the
+// same part
+void gang_check_sig(const uint8_t *sig) {
+  uint8_t check[3], differ = 0;
+  gang_hold(gang_failed);  // the negotiation's programming enables reached them too
+  for(uint8_t x = 0; x < GANG_SIZE; x++) { //**
+    if (!(gang_active & _BV(x))) continue;
+    gang_select(x);
+    read_sig(check);
+    if (memcmp(sig, check, 3) != 0) differ |= _BV(x);
+  }
+  gang_drop(differ);
+  gang_select(gang_lead);
+}
+
+// poll_ready() each target in turn
+uint8_t gang_wait_ready() {
+  uint8_t late = 0;
+  for(uint8_t x = 0; x < GANG_SIZE; x++) { //**
+    if (!(gang_active & _BV(x))) continue;
+    gang_select(x);
+    if (poll_ready() != STK_OK) late |= _BV(x);
+  }
+  gang_drop(late);
+  gang_select(gang_lead);
+  return gang_active ? STK_OK : STK_FAILED;
+}
+
+// Which targets don't hold the n bytes of page data that start at page_from in the ring, at word
+// address addr?  The data is taken through page_byte() again, from where it was (and, for a
+// packed page, how far it was unpacked) at the start of the page.  If stuck isn't NULL it gets the
+// targets that would need a bit set that's clear now, which only an erase can do.
+uint8_t gang_differs(uint32_t addr, uint16_t n, uint8_t *stuck) {
+  uint16_t resume = pBuffer;
+  unpack_state at = pack;
+  uint8_t differ = 0;
+  if (stuck) *stuck = 0;
+  for(uint8_t x = 0; x < GANG_SIZE; x++) { //**
+    if (!(gang_active & _BV(x))) continue;
+    gang_select(x);
+    pBuffer = page_from;
+    pack = pack_from;
+    for(uint16_t y = 0; y < n; y++) { //**
+      uint8_t was = flash_read(y & 1, addr + y / 2), b = page_byte();
+      if (b == was) continue;
+      differ |= _BV(x);
+      if (!stuck) break;
+      if (b & ~was) {
+        *stuck |= _BV(x);
+        break;
+      }
+    }
+  }
+  pBuffer = resume;
+  pack = at;
+  gang_select(gang_lead);
+  return differ;
+}
+
+#endif /* GANG_PROGRAMMING */
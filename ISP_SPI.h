@@ -0,0 +1,48 @@
+#ifndef _ISP_SPI_H
+#define _ISP_SPI_H
+
+// Streaming SPI for the four byte ISP instructions, shared by ASM_ISP.ino and ABD.cpp.
+//
+// SPI.transfer() reads SPDR back after every byte and, wrapped in spi_transaction() or program(),
+// costs a function call per instruction as well -- at SPI_CLOCK_DIV2 and DIV4 that's more time
+// than the bytes take on the wire.  These write SPDR directly, start each byte the moment SPIF
+// says the last one is out, and only read SPDR for the byte that carries a result.  They're all
+// inline, so the fixed patterns below fold their opcodes and address bytes at compile time.
+//
+// The SPI hardware still has to be set up with SPI.begin() and SPI.setClockDivider().
+
+#include <SPI.h>
+
+static inline void isp_out(uint8_t b) {
+  SPDR = b;
+  while (!(SPSR & _BV(SPIF)));
+}
+
+// one byte each way
+static inline uint8_t isp_xfer(uint8_t b) {
+  isp_out(b);
+  return SPDR;
+}
+
+// any instruction -- returns what the target sent back during the 4th byte
+static inline uint8_t isp_cmd(uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4) {
+  isp_out(b1); isp_out(b2); isp_out(b3); isp_out(b4);
+  return SPDR;
+}
+
+// Read Program Memory (0x20 low byte, 0x28 high byte) at a word address
+static inline uint8_t isp_read_flash(uint8_t hilo, uint16_t addr) {
+  return isp_cmd(hilo ? 0x28 : 0x20, addr >> 8, addr & 0xFF, 0x00);
+}
+
+// Load Program Memory Page (0x40 low byte, 0x48 high byte) at a word address
+static inline void isp_load_page(uint8_t hilo, uint16_t addr, uint8_t data) {
+  isp_cmd(hilo ? 0x48 : 0x40, addr >> 8, addr & 0xFF, data);
+}
+
+// Read EEPROM Memory (0xA0) at a byte address
+static inline uint8_t isp_read_eeprom(uint16_t addr) {
+  return isp_cmd(0xA0, addr >> 8, addr & 0xFF, 0xFF);
+}
+
+#endif /* _ISP_SPI_H */
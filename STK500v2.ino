@@ -0,0 +1,311 @@
+// STK500v2.ino -- STK500v2 (AVR068) command layer for ASM_ISP
+
+// Copyright 2015 Aaron Magill -- MIT LICENSE -- see LICENSE file for text of license
+
+// avrdude's stk500v2 programmer type talks to us through here instead of the STK500v1 commands
+// in avrisp().  There's no mode to switch: no v1 command starts with 0x1B, so frame_byte() frames
+// anything that does as a v2 message and avrisp() passes it to stk500v2().  We sign on as an
+// AVRISP v2, which is the simplest parameter set avrdude knows.
+//
+// v2 moves the paging and polling onto the programmer -- one CMD_PROGRAM_FLASH_ISP loads, writes
+// and waits out a whole page, one CMD_READ_FLASH_ISP reads one -- and checksums every message.
+// It's built on the same pieces as the v1 side: start_pmode(), write_flash(), write_eeprom() and
+// read_ahead(), with the v2 programming mode byte mapped onto the device parameters they use.
+// Word mode flash writes (only the old AT90S parts need them) aren't supported.
+//
+// Define STRIP_STK500V2 in ASM_ISP.h to leave it out.
+
+#ifndef STRIP_STK500V2
+
+#define STK2_TOKEN                 0x0E
+
+// commands
+#define CMD_SIGN_ON                0x01
+#define CMD_SET_PARAMETER          0x02
+#define CMD_GET_PARAMETER          0x03
+#define CMD_LOAD_ADDRESS           0x06
+#define CMD_ENTER_PROGMODE_ISP     0x10
+#define CMD_LEAVE_PROGMODE_ISP     0x11
+#define CMD_CHIP_ERASE_ISP         0x12
+#define CMD_PROGRAM_FLASH_ISP      0x13
+#define CMD_READ_FLASH_ISP         0x14
+#define CMD_PROGRAM_EEPROM_ISP     0x15
+#define CMD_READ_EEPROM_ISP        0x16
+#define CMD_PROGRAM_FUSE_ISP       0x17
+#define CMD_READ_FUSE_ISP          0x18
+#define CMD_PROGRAM_LOCK_ISP       0x19
+#define CMD_READ_LOCK_ISP          0x1A
+#define CMD_READ_SIGNATURE_ISP     0x1B
+#define CMD_READ_OSCCAL_ISP        0x1C
+#define CMD_SPI_MULTI              0x1D
+
+// answers
+#define ANSWER_CKSUM_ERROR         0xB0
+#define STATUS_CMD_OK              0x00
+#define STATUS_CMD_TOUT            0x80
+#define STATUS_RDY_BSY_TOUT        0x81
+#define STATUS_CMD_FAILED          0xC0
+#define STATUS_CKSUM_ERROR         0xC1
+#define STATUS_CMD_UNKNOWN         0xC9
+
+// parameters
+#define PARAM_HW_VER               0x90
+#define PARAM_SW_MAJOR             0x91
+#define PARAM_SW_MINOR             0x92
+#define PARAM_VTARGET              0x94
+#define PARAM_SCK_DURATION         0x98
+
+// programming mode byte of CMD_PROGRAM_FLASH_ISP/CMD_PROGRAM_EEPROM_ISP
+#define MODE_PAGE                  0x01  // page mode, else word mode
+#define MODE_VALUE_POLL            0x02  // after shifting the page or word mode timing bits down
+#define MODE_RDY_BSY               0x04
+#define MODE_WRITE_PAGE            0x80  // page mode: write the page after loading the data
+
+uint8_t stk2_seq;     // sequence number of the message we're answering
+uint8_t stk2_loaded;  // part of a flash page was loaded without MODE_WRITE_PAGE, and isn't written yet
+
+void stk2_put(uint8_t b) {
+  tx_sum ^= b;
+  Serial.write(b);
+}
+
+// reply header, for a body of size bytes which starts with the command we're answering
+void stk2_start(uint16_t size, uint8_t cmd) {
+  tx_sum = 0;
+  stk2_put(STK2_START);
+  stk2_put(stk2_seq);
+  stk2_put(size >> 8);
+  stk2_put(size & 0xFF);
+  stk2_put(STK2_TOKEN);
+  stk2_put(cmd);
+}
+
+void stk2_end() {
+  Serial.write(tx_sum);
+}
+
+void stk2_status(uint8_t cmd, uint8_t status) {
+  stk2_start(2, cmd);
+  stk2_put(status);
+  stk2_end();
+}
+
+// v2 SCK_DURATION isn't in the v1 units of sck_duration() -- avrdude picks 0 for anything from
+// 1.8432MHz up, 1 above 460.8kHz, 2 above 115.2kHz and 3 and up below that.  Anything past 2
+// just means our slowest rate, SPI_CLOCK_DIV128.
+uint8_t stk2_sck_duration() {
+  uint32_t f = F_CPU / (128 >> spi_rate);
+  if (f >= 1843200) return 0;
+  if (f > 460800) return 1;
+  return 2;
+}
+
+void stk2_sck_limit(uint8_t d) {
+  uint32_t fmax = (d == 0) ? F_CPU : (d == 1) ? 460800 : 115200;
+  spi_limit = sizeof(spi_dividers) - 1;
+  while (spi_limit > 0 && F_CPU / (128 >> spi_limit) > fmax) spi_limit--;
+}
+
+// CMD_PROGRAM_FLASH_ISP and CMD_PROGRAM_EEPROM_ISP -- the data is written straight out of the ring.
+// In page mode without MODE_WRITE_PAGE the data is only loaded, and the host writes the page with a
+// later message that has it set; delta writes are off until then, since the part already loaded
+// has to be written whatever the rest compares as.
+uint8_t stk2_program(uint8_t cmd) {
+  uint16_t length = getch16();
+  uint8_t  mode = getch();
+  getch();                   // delay -- we use our own worst case, see TWD_FLASH and TWD_EEPROM
+  getch(); getch(); getch(); // load, write and read instructions -- the same on every ISP part
+  uint8_t  poll1 = getch();
+  uint8_t  poll2 = getch();
+  if (length > 256) return STATUS_CMD_FAILED;
+
+  uint8_t timing = (mode & MODE_PAGE) ? mode >> 4 : mode >> 1;
+  param.polling   = timing & MODE_RDY_BSY;
+  param.selftimed = timing & MODE_VALUE_POLL;
+  uint8_t result;
+  page_commit = !(mode & MODE_PAGE) || (mode & MODE_WRITE_PAGE);
+  if (cmd == CMD_PROGRAM_FLASH_ISP) {
+    if (!(mode & MODE_PAGE)) return STATUS_CMD_FAILED;
+    uint8_t d = delta;
+    if (!page_commit || stk2_loaded) delta = 0;
+    param.pagesize  = length;
+    param.flashpoll = poll1;
+    result = write_flash(length);
+    delta = d;
+    stk2_loaded = !page_commit;
+  } else {
+    // a v2 EEPROM address is a byte address
+    param.eeprompage = (mode & MODE_PAGE) ? length : 0;
+    param.eeprompoll = poll1 * 256 + poll2;
+    result = write_eeprom(_addr, length);
+    _addr += length;
+  }
+  page_commit = 1;
+  return (result == STK_OK) ? STATUS_CMD_OK : STATUS_CMD_TOUT;
+}
+
+// CMD_READ_FLASH_ISP and CMD_READ_EEPROM_ISP
+void stk2_read(uint8_t cmd) {
+  uint16_t length = getch16();
+  stk2_start(length + 3, cmd);
+  stk2_put(STATUS_CMD_OK);
+  if (cmd == CMD_READ_FLASH_ISP) {
+    read_ahead('F', _addr * 2, length);
+    _addr += (length + 1) / 2;
+  } else {
+    read_ahead('E', _addr, length);
+    _addr += length;
+  }
+  stk2_put(STATUS_CMD_OK);
+  stk2_end();
+}
+
+// CMD_SPI_MULTI -- what comes back goes into the ring after the frame until it's all in
+void stk2_spi_multi() {
+  uint8_t tx = getch();
+  uint8_t rx = getch();
+  uint8_t rxstart = getch();
+  for(uint16_t x = 0; x < tx || x < rxstart + rx; x++) { //**
+    PERF_SPI(1);
+    uint8_t b = isp_xfer(x < tx ? getch() : 0x00);
+    if (x >= rxstart && x < rxstart + rx) ring[ring_at(iBuffer, x - rxstart)] = b;
+  }
+  stk2_start(rx + 3, CMD_SPI_MULTI);
+  stk2_put(STATUS_CMD_OK);
+  for(uint8_t x = 0; x < rx; x++) stk2_put(ring[ring_at(iBuffer, x)]); //**
+  stk2_put(STATUS_CMD_OK);
+  stk2_end();
+}
+
+// Called by avrisp() once it has taken the 0x1B off the front of the frame.
+void stk500v2() {
+  uint16_t start = pBuffer ? pBuffer - 1 : RING_SIZE - 1;
+  stk2_seq = getch();
+  uint16_t size = getch16();
+  uint8_t sum = 0;
+  if (size <= STK2_MAX_BODY) {
+    for(uint16_t x = 0; x < size + 6; x++) sum ^= ring[ring_at(start, x)]; //** the checksum makes it 0
+  }
+  if (size > STK2_MAX_BODY || getch() != STK2_TOKEN || sum != 0) {
+    error++;
+    stk2_status(ANSWER_CKSUM_ERROR, STATUS_CKSUM_ERROR);
+    return;
+  }
+
+  uint8_t cmd = getch();
+  uint8_t p, v, result, b[4];
+  switch (cmd) {
+    case CMD_SIGN_ON:
+                            stk2_start(11, cmd);
+                            stk2_put(STATUS_CMD_OK);
+                            stk2_put(8);
+                            for(const char *s = "AVRISP_2"; *s; s++) stk2_put(*s);
+                            stk2_end();
+                            break;
+    case CMD_SET_PARAMETER:
+                            p = getch();
+                            v = getch();
+                            if (p == PARAM_SCK_DURATION) stk2_sck_limit(v);
+                            stk2_status(cmd, STATUS_CMD_OK);  // the rest don't apply to us
+                            break;
+    case CMD_GET_PARAMETER:
+                            switch (getch()) {
+                              case PARAM_HW_VER:       v = HWVER; break;
+                              case PARAM_SW_MAJOR:     v = SWMAJ; break;
+                              case PARAM_SW_MINOR:     v = SWMIN; break;
+                              case PARAM_VTARGET:      v = 50;    break;  // 5.0V, we can't measure it
+                              case PARAM_SCK_DURATION: v = stk2_sck_duration(); break;
+                              default:                 v = 0;
+                            }
+                            stk2_start(3, cmd);
+                            stk2_put(STATUS_CMD_OK);
+                            stk2_put(v);
+                            stk2_end();
+                            break;
+    case CMD_LOAD_ADDRESS:
+                            // bit 31 asks for a Load Extended Address, load_ext_addr() takes care of that
+                            _addr = (uint32_t)getch16() << 16;
+                            _addr = (_addr | getch16()) & 0x00FFFFFF;
+                            stk2_status(cmd, STATUS_CMD_OK);
+                            break;
+    case CMD_ENTER_PROGMODE_ISP:
+                            // timings and the enable instruction -- start_pmode() has its own
+                            beep(3000, 50);
+                            result = STATUS_CMD_OK;
+                            if (pmode) {
+                              pulse(LED_ERR, 3);
+                            } else if (!start_pmode()) {
+                              error++;
+                              result = STATUS_CMD_FAILED;
+                            }
+                            stk2_status(cmd, result);
+                            break;
+    case CMD_LEAVE_PROGMODE_ISP:
+                            beep(1000, 50);
+                            error = 0;
+                            end_pmode();
+                            stk2_status(cmd, STATUS_CMD_OK);
+                            break;
+    case CMD_CHIP_ERASE_ISP:
+                            v = getch();         // erase delay
+                            param.polling = getch();
+                            for(p = 0; p < 4; p++) b[p] = getch(); //**
+                            spi_transaction(b[0], b[1], b[2], b[3]);
+                            erased = 1;
+                            poll_cmd = 0;
+                            result = wait_ready(v);
+                            stk2_status(cmd, (result == STK_OK) ? STATUS_CMD_OK : STATUS_RDY_BSY_TOUT);
+                            break;
+    case CMD_PROGRAM_FLASH_ISP:
+    case CMD_PROGRAM_EEPROM_ISP:
+                            result = stk2_program(cmd);
+                            if (result != STATUS_CMD_OK) error++;
+                            stk2_status(cmd, result);
+                            break;
+    case CMD_READ_FLASH_ISP:
+    case CMD_READ_EEPROM_ISP:
+                            stk2_read(cmd);
+                            break;
+    case CMD_PROGRAM_FUSE_ISP:
+    case CMD_PROGRAM_LOCK_ISP:
+                            for(p = 0; p < 4; p++) b[p] = getch(); //**
+                            spi_transaction(b[0], b[1], b[2], b[3]);
+                            // the host goes straight on to read it back, so wait the write out
+                            if (wait_ready(TWD_FUSE) != STK_OK) {
+                              error++;
+                              stk2_status(cmd, STATUS_CMD_TOUT);
+                              break;
+                            }
+                            stk2_start(3, cmd);
+                            stk2_put(STATUS_CMD_OK);
+                            stk2_put(STATUS_CMD_OK);
+                            stk2_end();
+                            break;
+    case CMD_READ_FUSE_ISP:
+    case CMD_READ_LOCK_ISP:
+    case CMD_READ_SIGNATURE_ISP:
+    case CMD_READ_OSCCAL_ISP:
+                            // first argument says which of the four bytes clocked out has the answer
+                            p = getch();
+                            v = 0;
+                            for(uint8_t x = 1; x <= 4; x++) { //**
+                              PERF_SPI(1);
+                              uint8_t r = isp_xfer(getch());
+                              if (x == p) v = r;
+                            }
+                            stk2_start(4, cmd);
+                            stk2_put(STATUS_CMD_OK);
+                            stk2_put(v);
+                            stk2_put(STATUS_CMD_OK);
+                            stk2_end();
+                            break;
+    case CMD_SPI_MULTI:
+                            stk2_spi_multi();
+                            break;
+    default:
+                            error++;
+                            stk2_status(cmd, STATUS_CMD_UNKNOWN);
+  }
+}
+
+#endif /* STRIP_STK500V2 */
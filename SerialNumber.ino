@@ -0,0 +1,107 @@
+// SerialNumber.ino -- per unit serial numbers for ASM_ISP
+
+// Copyright 2015 Aaron Magill -- MIT LICENSE -- see LICENSE file for text of license
+
+// The host sets a template up once with STK_SERIAL_SET: where the number goes in the target's
+// EEPROM, how many bytes it takes, how they're written and the next number to hand out.  From then
+// on write_eeprom() puts the current number over whatever the host sent for those bytes, and each
+// programming session that wrote it moves the counter on, so a production run doesn't need an
+// EEPROM pass of its own for every board.  Stamp mode goes through write_eeprom() too.
+//
+// The template and the counter live in our own EEPROM, so they survive a power cycle.  A number
+// is used up by any session that writes it, good board or not, so no two boards share one -- but
+// in gang mode every target in the session gets the same one.  STK_SERIAL_GET reads it all back,
+// so the host can log which number a board got.  Reading the target's EEPROM back shows the
+// number, not what the host sent, so a verify against the original file will flag those bytes.
+//
+// Formats:
+//   0  binary, little endian (how avr-gcc stores an integer), up to 4 bytes
+//   1  binary, big endian, up to 4 bytes
+//   2  ASCII decimal, zero padded on the left, up to 10 bytes -- only the low digits fit if the
+//      number outgrows the width
+
+#define SERIAL_EEPROM  0       // where the template starts in our own EEPROM
+#define SERIAL_MAGIC   0x4E53  // 'S' 'N'
+
+uint16_t serial_offset;  // byte address in the target's EEPROM
+uint8_t  serial_width;   // bytes, 0 when there's no template
+uint8_t  serial_format;
+uint32_t serial_value;   // the number the next board gets
+uint8_t  serial_used;    // this session wrote it
+
+void serial_setup() {
+  if (eeprom_read_word((uint16_t *)SERIAL_EEPROM) != SERIAL_MAGIC) return;
+  serial_offset = eeprom_read_word((uint16_t *)(SERIAL_EEPROM + 2));
+  serial_width  = eeprom_read_byte((uint8_t *)(SERIAL_EEPROM + 4));
+  serial_format = eeprom_read_byte((uint8_t *)(SERIAL_EEPROM + 5));
+  serial_value  = eeprom_read_dword((uint32_t *)(SERIAL_EEPROM + 6));
+}
+
+// the byte to write to target EEPROM address addr, in place of data
+uint8_t serial_patch(uint16_t addr, uint8_t data) {
+  uint16_t at = addr - serial_offset; //** wraps to well past the width below the offset
+  if (at >= serial_width) return data;
+  serial_used = 1;
+  uint32_t v = serial_value; //**
+  switch (serial_format) {
+    case 0:  return v >> (8 * at);
+    case 1:  return v >> (8 * (serial_width - 1 - at));
+    default: for(uint8_t x = serial_width - 1; x > at; x--) v /= 10; //**
+             return '0' + v % 10;
+  }
+}
+
+// end_pmode() -- on to the next number if this session used this one
+void serial_next() {
+  if (!serial_used) return;
+  serial_used = 0;
+  serial_value++;
+  eeprom_update_dword((uint32_t *)(SERIAL_EEPROM + 6), serial_value);
+}
+
+// STK_SERIAL_SET: 16 bit EEPROM offset, width, format, 32 bit next number, big endian.  A width
+// of 0 turns it off.
+void serial_set() {
+  uint16_t offset = getch16();
+  uint8_t width = getch(), format = getch();
+  uint32_t value = (uint32_t)getch16() << 16; //**
+  value |= getch16();
+  if (CRC_EOP != getch()) {
+    error++;
+    reply_nosync();
+    return;
+  }
+  Serial.write(STK_INSYNC);
+  if (format > 2 || width > (format == 2 ? 10 : 4)) {
+    error++;
+    Serial.write(STK_FAILED);
+    return;
+  }
+  serial_offset = offset;
+  serial_width  = width;
+  serial_format = format;
+  serial_value  = value;
+  serial_used   = 0;
+  eeprom_update_word((uint16_t *)SERIAL_EEPROM, SERIAL_MAGIC);
+  eeprom_update_word((uint16_t *)(SERIAL_EEPROM + 2), serial_offset);
+  eeprom_update_byte((uint8_t *)(SERIAL_EEPROM + 4), serial_width);
+  eeprom_update_byte((uint8_t *)(SERIAL_EEPROM + 5), serial_format);
+  eeprom_update_dword((uint32_t *)(SERIAL_EEPROM + 6), serial_value);
+  Serial.write(STK_OK);
+}
+
+// STK_SERIAL_GET returns the template as STK_SERIAL_SET takes it, with the next number to use
+void serial_get() {
+  if (CRC_EOP != getch()) {
+    error++;
+    reply_nosync();
+    return;
+  }
+  Serial.write(STK_INSYNC);
+  Serial.write(serial_offset >> 8);
+  Serial.write(serial_offset & 0xFF);
+  Serial.write(serial_width);
+  Serial.write(serial_format);
+  for(int8_t x = 24; x >= 0; x -= 8) Serial.write((serial_value >> x) & 0xFF); //**
+  Serial.write(STK_OK);
+}
@@ -0,0 +1,275 @@
+// Stamp.ino -- standalone "stamp" programming for ASM_ISP
+
+// Copyright 2015 Aaron Magill -- MIT LICENSE -- see LICENSE file for text of license
+
+// Keeps a complete target image -- flash, EEPROM, fuses and lock bits -- in a 25 series SPI flash
+// chip (a W25Q32, say), loaded once from the host with STK_STAMP_ERASE and STK_STAMP_WRITE.  After
+// that, grounding STAMP_BUTTON programs a board with no host attached: chip erase, flash, EEPROM,
+// a read back of the flash, then fuses and lock bits.  Blank flash pages aren't written.  The
+// programming LED is on while it works, then it's a high beep for a good board, or a long low one
+// and the error LED for a bad one.  STK_STAMP does the same from the host.
+//
+// The storage chip has pins of its own and is bit-banged: a target in programming mode drives
+// MISO the whole time, so it can't share the hardware SPI bus.  Its pins are the gang select pins,
+// so it's one or the other.
+//
+// Image layout on the storage chip, multi-byte values big endian:
+//
+//    0  'A' 'S' 'M' 'S'
+//    4  signature, 3 bytes -- nothing is written to a target that doesn't match
+//    7  which of the next 4 to write: bit 0 low fuse, 1 high fuse, 2 extended fuse, 3 lock bits
+//    8  low fuse, high fuse, extended fuse, lock bits
+//   12  flash image length in bytes, 4 bytes
+//   16  flash page size in bytes, 2 bytes
+//   18  EEPROM image length in bytes, 2 bytes
+//   20  EEPROM page size in bytes, 0 to write it a byte at a time
+//   21  1 to poll RDY/BSY for the end of each write, 0 to wait out the worst case
+//  256  flash image, then the EEPROM image at the next 256 byte boundary
+//
+// Define STAMP_MODE in ASM_ISP.h to build it in.
+
+#ifdef STAMP_MODE
+
+// 25 series SPI flash instructions
+#define SF_PROGRAM        0x02  // page program, wraps at 256 byte boundaries
+#define SF_READ           0x03
+#define SF_STATUS         0x05  // bit 0 is busy
+#define SF_WRITE_ENABLE   0x06
+#define SF_ERASE_64K      0xD8
+
+// longest a write can keep the storage chip busy, in ms -- a W25Q32 datasheet's maximums, rounded up
+#define SF_TWD_PROGRAM       5
+#define SF_TWD_ERASE_64K  2000
+
+#define STAMP_HEADER        22  // bytes of the header we use
+#define STAMP_IMAGE        256  // where the flash image starts
+#define STAMP_DEBOUNCE      50  // ms STAMP_BUTTON has to stay up before it can be pressed again
+
+uint8_t sf_xfer(uint8_t b) {
+  uint8_t in = 0;
+  for(uint8_t x = 0; x < 8; x++) { //**
+    FastPin<STAMP_MOSI>::write(b & 0x80);
+    b <<= 1;
+    FastPin<STAMP_SCK>::high();
+    in = (in << 1) | FastPin<STAMP_MISO>::read();
+    FastPin<STAMP_SCK>::low();
+  }
+  return in;
+}
+
+void sf_start(uint8_t cmd, uint32_t addr) {
+  FastPin<STAMP_CS>::low();
+  sf_xfer(cmd);
+  sf_xfer(addr >> 16);
+  sf_xfer(addr >> 8);
+  sf_xfer(addr);
+}
+
+void sf_end() {
+  FastPin<STAMP_CS>::high();
+}
+
+void sf_write_enable() {
+  FastPin<STAMP_CS>::low();
+  sf_xfer(SF_WRITE_ENABLE);
+  FastPin<STAMP_CS>::high();
+}
+
+// wait for a write to finish, for up to twd ms -- a chip that's missing reads as busy forever
+uint8_t sf_wait(uint16_t twd) {
+  uint8_t result = STK_OK;
+  uint32_t start = millis();
+  FastPin<STAMP_CS>::low();
+  sf_xfer(SF_STATUS);
+  while (sf_xfer(0x00) & 0x01) {
+    if (millis() - start > twd) {
+      result = STK_FAILED;
+      break;
+    }
+  }
+  FastPin<STAMP_CS>::high();
+  return result;
+}
+
+// n bytes of storage at addr into the ring, starting at index at
+void sf_read_ring(uint32_t addr, uint16_t at, uint16_t n) { //**
+  sf_start(SF_READ, addr);
+  for(uint16_t x = 0; x < n; x++) ring[ring_at(at, x)] = sf_xfer(0x00); //**
+  sf_end();
+}
+
+void stamp_setup() {
+  FastPin<STAMP_CS>::high();
+  FastPin<STAMP_CS>::output();
+  FastPin<STAMP_SCK>::output();
+  FastPin<STAMP_MOSI>::output();
+  FastPin<STAMP_MISO>::input();
+  FastPin<STAMP_BUTTON>::input_pullup();
+}
+
+// Program the target from storage, true if it all went in.  The image goes through the ring a
+// chunk at a time, where write_flash() and write_eeprom() expect their data, so there has to be
+// no frame half way in.
+uint8_t stamp_target() {
+  uint8_t h[STAMP_HEADER];
+  sf_start(SF_READ, 0);
+  for(uint8_t x = 0; x < STAMP_HEADER; x++) h[x] = sf_xfer(0x00); //**
+  sf_end();
+  if (memcmp(h, "ASMS", 4) != 0) return 0;
+  uint32_t flash_len = ((uint32_t)h[12] << 24) | ((uint32_t)h[13] << 16) | (h[14] << 8) | h[15]; //**
+  uint16_t eeprom_len = (h[18] << 8) | h[19]; //**
+  param.pagesize   = (h[16] << 8) | h[17];
+  param.eeprompage = h[20];
+  param.eeprompoll = 0xFFFF;
+  param.polling    = h[21];
+  param.selftimed  = 0;
+
+  stamping = 1;
+  uint16_t at = iBuffer; //**
+  uint8_t ok = start_pmode(), sig[3];
+  if (ok) {
+    read_sig(sig);
+    ok = (memcmp(sig, h + 4, 3) == 0);
+  }
+  if (ok) {
+    spi_transaction(0xAC, 0x80, 0x00, 0x00);  // Chip Erase
+    erased = 1;
+    ok = (wait_ready(TWD_ERASE) == STK_OK);
+  }
+  for(uint32_t a = 0; ok && a < flash_len; a += 256) { //**
+    uint16_t n = (flash_len - a < 256) ? flash_len - a : 256; //**
+    sf_read_ring(STAMP_IMAGE + a, at, n);
+    uint8_t blank = 1;
+    for(uint16_t x = 0; x < n && blank; x++) blank = (ring[ring_at(at, x)] == 0xFF); //**
+    if (blank) continue;
+    pBuffer = at;
+    iBuffer = ring_at(at, n);
+    _addr = a / 2;
+    ok = (write_flash(n) == STK_OK);
+  }
+  uint32_t eeprom_at = STAMP_IMAGE + ((flash_len + 255) & ~0xFFUL); //**
+  for(uint16_t a = 0; ok && a < eeprom_len; a += 256) { //**
+    uint16_t n = (eeprom_len - a < 256) ? eeprom_len - a : 256; //**
+    sf_read_ring(eeprom_at + a, at, n);
+    pBuffer = at;
+    iBuffer = ring_at(at, n);
+    ok = (write_eeprom(a, n) == STK_OK);
+  }
+  // read the flash back before the lock bits can stop us
+  for(uint32_t a = 0; ok && a < flash_len; a += 256) { //**
+    uint16_t n = (flash_len - a < 256) ? flash_len - a : 256; //**
+    sf_read_ring(STAMP_IMAGE + a, at, n);
+    for(uint16_t x = 0; x < n && ok; x++) ok = (read_byte('F', a + x) == ring[ring_at(at, x)]); //**
+  }
+  const uint8_t fuse_cmds[4] = { 0xA0, 0xA8, 0xA4, 0xE0 };
+  for(uint8_t f = 0; ok && f < 4; f++) { //**
+    if (!(h[7] & _BV(f))) continue;
+    spi_transaction(0xAC, fuse_cmds[f], 0x00, h[8 + f]);
+    ok = (wait_ready(TWD_FUSE) == STK_OK);
+  }
+  end_pmode();
+  pBuffer = iBuffer = at;
+  stamping = 0;
+  return ok;
+}
+
+// STAMP_BUTTON was pressed
+void stamp() {
+  lamp = 1;
+  beep(3000, 50);
+  if (stamp_target()) {
+    error = 0;
+    beep(500, 200);
+  } else {
+    error++;
+    beep(3000, 500);
+  }
+  lamp = 0;
+  // one board per press -- wait for the button to be let go, and not bounce, for STAMP_DEBOUNCE
+  uint32_t up = millis(); //**
+  while (millis() - up < STAMP_DEBOUNCE) {
+    if (FastPin<STAMP_BUTTON>::read() == LOW) up = millis();
+  }
+}
+
+// STK_STAMP does what STAMP_BUTTON does, for the host
+void stamp_command() {
+  if (CRC_EOP != getch()) {
+    error++;
+    reply_nosync();
+    return;
+  }
+  Serial.write(STK_INSYNC);
+  uint8_t result = (!pmode && stamp_target()) ? STK_OK : STK_FAILED;
+  if (result != STK_OK) error++;
+  Serial.write(result);
+}
+
+// STK_STAMP_ERASE erases the first count 64K blocks of storage
+void stamp_erase() {
+  uint8_t blocks = getch();
+  if (CRC_EOP != getch()) {
+    error++;
+    reply_nosync();
+    return;
+  }
+  uint8_t result = STK_OK;
+  for(uint8_t b = 0; b < blocks && result == STK_OK; b++) { //**
+    sf_write_enable();
+    sf_start(SF_ERASE_64K, (uint32_t)b << 16);
+    sf_end();
+    result = sf_wait(SF_TWD_ERASE_64K);
+  }
+  if (result != STK_OK) error++;
+  Serial.write(STK_INSYNC);
+  Serial.write(result);
+}
+
+// STK_STAMP_WRITE stores up to 256 bytes at a 24 bit address, into erased storage
+void stamp_write() {
+  uint32_t addr = (uint32_t)getch() << 16; //**
+  addr |= getch16();
+  uint16_t n = getch16();
+  uint16_t eop = ring_at(pBuffer, n); //**
+  if (n > 256 || CRC_EOP != ring[eop]) {
+    error++;
+    reply_nosync();
+    return;
+  }
+  uint8_t result = STK_OK;
+  while (n > 0 && result == STK_OK) {
+    // a page program wraps at the 256 byte boundary, so split there
+    uint16_t k = 256 - (addr & 0xFF); //**
+    if (k > n) k = n;
+    sf_write_enable();
+    sf_start(SF_PROGRAM, addr);
+    for(uint16_t x = 0; x < k; x++) sf_xfer(getch()); //**
+    sf_end();
+    result = sf_wait(SF_TWD_PROGRAM);
+    addr += k;
+    n -= k;
+  }
+  pBuffer = ring_next(eop);  // past whatever a failed write left unread
+  if (result != STK_OK) error++;
+  Serial.write(STK_INSYNC);
+  Serial.write(result);
+}
+
+// STK_STAMP_READ reads back up to 65535 bytes from a 24 bit address
+void stamp_read() {
+  uint32_t addr = (uint32_t)getch() << 16; //**
+  addr |= getch16();
+  uint16_t n = getch16();
+  if (CRC_EOP != getch()) {
+    error++;
+    reply_nosync();
+    return;
+  }
+  Serial.write(STK_INSYNC);
+  sf_start(SF_READ, addr);
+  for(uint16_t x = 0; x < n; x++) Serial.write(sf_xfer(0x00)); //**
+  sf_end();
+  Serial.write(STK_OK);
+}
+
+#endif /* STAMP_MODE */
@@ -0,0 +1,73 @@
+// Minimal Arduino core stand-in for host builds
+#ifndef _HOST_ARDUINO_H
+#define _HOST_ARDUINO_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "avr/io.h"
+#include "avr/pgmspace.h"
+#include "avr/interrupt.h"
+
+typedef bool    boolean;
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW  0x0
+#define INPUT        0x0
+#define OUTPUT       0x1
+#define INPUT_PULLUP 0x2
+#define DEC 10
+#define HEX 16
+#define BIN 2
+
+#define lowByte(w)  ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#define bit(b)      (1UL << (b))
+#ifndef _BV
+#define _BV(b)      (1 << (b))
+#endif
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int  digitalRead(uint8_t pin);
+void analogWrite(uint8_t pin, int val);
+void delay(unsigned long ms);
+void noInterrupts();
+void interrupts();
+void delayMicroseconds(unsigned int us);
+unsigned long millis();
+unsigned long micros();
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+
+class HardwareSerial {
+public:
+  void   begin(unsigned long baud);
+  void   end() {}
+  int    available();
+  int    availableForWrite();
+  int    read();
+  int    peek();
+  void   flush();
+  size_t write(uint8_t b);
+  size_t write(const char *s);
+  size_t write(const uint8_t *b, size_t n);
+  size_t print(const char *s);
+  size_t print(const __FlashStringHelper *s) { return print(reinterpret_cast<const char *>(s)); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t println() { return write("\r\n"); }
+  template <typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+  template <typename T> size_t println(T v, int base) { size_t n = print(v, base); return n + println(); }
+  operator bool() { return true; }
+};
+extern HardwareSerial Serial;
+
+#include "pins_arduino.h"
+#endif
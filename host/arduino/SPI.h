@@ -0,0 +1,23 @@
+#ifndef _HOST_SPI_H
+#define _HOST_SPI_H
+#include <Arduino.h>
+#define SPI_CLOCK_DIV4   0x00
+#define SPI_CLOCK_DIV16  0x01
+#define SPI_CLOCK_DIV64  0x02
+#define SPI_CLOCK_DIV128 0x03
+#define SPI_CLOCK_DIV2   0x04
+#define SPI_CLOCK_DIV8   0x05
+#define SPI_CLOCK_DIV32  0x06
+#define MSBFIRST 1
+#define LSBFIRST 0
+class SPIClass {
+public:
+  static void begin();
+  static void end();
+  static uint8_t transfer(uint8_t data);
+  static void setClockDivider(uint8_t div);
+  static void setDataMode(uint8_t) {}
+  static void setBitOrder(uint8_t) {}
+};
+extern SPIClass SPI;
+#endif
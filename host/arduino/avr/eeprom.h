@@ -0,0 +1,12 @@
+#ifndef _HOST_EEPROM_H
+#define _HOST_EEPROM_H
+#include <stdint.h>
+// the programmer's own EEPROM, which survives sim::reset() like it survives a power cycle
+namespace sim { extern uint8_t ownEeprom[1024]; }
+static inline uint8_t  eeprom_read_byte(const uint8_t *p) { return sim::ownEeprom[(uintptr_t)p & 1023]; }
+static inline uint16_t eeprom_read_word(const uint16_t *p) { uintptr_t a = (uintptr_t)p; return sim::ownEeprom[a & 1023] | (sim::ownEeprom[(a + 1) & 1023] << 8); }
+static inline uint32_t eeprom_read_dword(const uint32_t *p) { uintptr_t a = (uintptr_t)p; return eeprom_read_word((const uint16_t *)a) | ((uint32_t)eeprom_read_word((const uint16_t *)(a + 2)) << 16); }
+static inline void eeprom_update_byte(uint8_t *p, uint8_t v) { sim::ownEeprom[(uintptr_t)p & 1023] = v; }
+static inline void eeprom_update_word(uint16_t *p, uint16_t v) { uintptr_t a = (uintptr_t)p; eeprom_update_byte((uint8_t *)a, v); eeprom_update_byte((uint8_t *)(a + 1), v >> 8); }
+static inline void eeprom_update_dword(uint32_t *p, uint32_t v) { uintptr_t a = (uintptr_t)p; eeprom_update_word((uint16_t *)a, v); eeprom_update_word((uint16_t *)(a + 2), v >> 16); }
+#endif
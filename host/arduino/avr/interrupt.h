@@ -0,0 +1,6 @@
+#ifndef _HOST_INTERRUPT_H
+#define _HOST_INTERRUPT_H
+#define ISR(vec) void vec(void)
+#define sei()
+#define cli()
+#endif
@@ -0,0 +1,30 @@
+// The handful of ATmega328P registers the sketch touches, as plain memory
+#ifndef _HOST_IO_H
+#define _HOST_IO_H
+#include <stdint.h>
+#define F_CPU 16000000UL
+extern volatile uint8_t DDRB, PORTB, PINB, DDRC, PORTC, PINC, DDRD, PORTD, PIND;
+extern volatile uint8_t OCR2A, OCR2B, TCCR2A, TCCR2B, TCNT2, MCUSR;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint16_t ICR1, OCR1A;
+#define COM1A1 7
+#define WGM11  1
+#define WGM12  3
+#define WGM13  4
+#define CS11   1
+#define TOIE1  0
+#define COM2B0 4
+#define WGM21  1
+#define CS20   0
+#define CS21   1
+#define CS22   2
+// SPI data register: writing it clocks a byte to the target, reading it gives the byte back.
+// A transfer here is always finished by the time SPSR is looked at.
+struct SpdrReg { SpdrReg &operator=(uint8_t b); operator uint8_t() const; };
+extern SpdrReg SPDR;
+extern volatile uint8_t SPSR;
+#define SPIF 7
+#ifndef _BV
+#define _BV(b) (1 << (b))
+#endif
+#endif
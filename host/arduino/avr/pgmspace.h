@@ -0,0 +1,12 @@
+#ifndef _HOST_PGMSPACE_H
+#define _HOST_PGMSPACE_H
+#include <string.h>
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(p))
+#define pgm_read_word(p) (*(p))
+#define pgm_read_dword(p) (*(p))
+#define pgm_read_ptr(p)  (*(p))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#endif
@@ -0,0 +1,6 @@
+#ifndef _HOST_WDT_H
+#define _HOST_WDT_H
+#define WDTO_15MS 0
+void wdt_enable(int);
+void wdt_disable();
+#endif
@@ -0,0 +1,15 @@
+// UNO pin numbering for host builds
+#ifndef _HOST_PINS_ARDUINO_H
+#define _HOST_PINS_ARDUINO_H
+#include <stdint.h>
+static const uint8_t SS   = 10;
+static const uint8_t MOSI = 11;
+static const uint8_t MISO = 12;
+static const uint8_t SCK  = 13;
+static const uint8_t A0 = 14;
+static const uint8_t A1 = 15;
+static const uint8_t A2 = 16;
+static const uint8_t A3 = 17;
+static const uint8_t A4 = 18;
+static const uint8_t A5 = 19;
+#endif
@@ -0,0 +1,126 @@
+// The sketch on a pseudo terminal: avrdude (or anything else that speaks STK500) opens the pty
+// this prints, and talks to ASM_ISP with the target model on the other end of the SPI bus.
+//
+//   asm_isp [-p m328p|m2560|m8a|t85] [-l link] [-d dumpfile] [-r tracefile]
+//
+//   -p  the part on the bus, m328p by default
+//   -l  also make link a symlink to the pty, so there's a fixed name to hand avrdude
+//   -d  write the target's flash out to dumpfile on the way out (SIGINT or SIGTERM)
+//   -r  record the session to tracefile, for bench to replay (see traces.py for the format)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <Arduino.h>
+#include "sim.h"
+#include "target.h"
+
+void setup(); void loop();
+
+static const char *link_name, *dump_name;
+static volatile sig_atomic_t stop;
+static FILE *trace;
+
+// a line per direction, and a pause wherever the host took a while to answer a reply -- avrdude
+// waiting out an erase or a fuse write
+static void record(bool from_host, const uint8_t *b, size_t n) {
+  static int dir = -1;
+  static double last;
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  double now = t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+  if (dir != from_host) {
+    if (dir >= 0) fputc('\n', trace);
+    if (from_host && dir == 0 && now - last >= 2) fprintf(trace, ". %.1f\n", now - last);
+    fputc(from_host ? '>' : '<', trace);
+    dir = from_host;
+  }
+  for (size_t i = 0; i < n; i++) fprintf(trace, " %02x", b[i]);
+  last = now;
+}
+
+// the sketch may be waiting on the link inside loop(), so run the virtual clock out as well
+static void on_signal(int) { stop = 1; sim::deadline_ns = 0; }
+
+static void finish() {
+  if (dump_name) {
+    FILE *f = fopen(dump_name, "wb");
+    if (f) {
+      fwrite(target.flash.data(), 1, target.flash.size(), f);
+      fclose(f);
+    } else {
+      perror(dump_name);
+    }
+  }
+  if (link_name) unlink(link_name);
+  if (trace) {
+    fputc('\n', trace);
+    fclose(trace);
+  }
+}
+
+int main(int argc, char **argv) {
+  const TargetConfig *part = &ATMEGA328P;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:l:d:r:")) != -1) {
+    switch (opt) {
+      case 'p':
+        if      (!strcmp(optarg, "m328p")) part = &ATMEGA328P;
+        else if (!strcmp(optarg, "m2560")) part = &ATMEGA2560;
+        else if (!strcmp(optarg, "m8a"))   part = &ATMEGA8A;
+        else if (!strcmp(optarg, "t85"))   part = &ATTINY85;
+        else { fprintf(stderr, "unknown part %s\n", optarg); return 2; }
+        break;
+      case 'l': link_name = optarg; break;
+      case 'd': dump_name = optarg; break;
+      case 'r':
+        if (!(trace = fopen(optarg, "w"))) { perror(optarg); return 1; }
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-p m328p|m2560|m8a|t85] [-l link] [-d dumpfile] [-r tracefile]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) { perror("pty"); return 1; }
+  const char *slave_name = ptsname(master);
+  // keep the slave open ourselves, raw, so the master doesn't see a hangup between avrdude runs
+  // and the line discipline doesn't eat 0x0D or 0x11 out of a frame before avrdude gets there
+  int slave = open(slave_name, O_RDWR | O_NOCTTY);
+  if (slave < 0) { perror(slave_name); return 1; }
+  struct termios t;
+  tcgetattr(slave, &t);
+  cfmakeraw(&t);
+  tcsetattr(slave, TCSANOW, &t);
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+  if (link_name) {
+    unlink(link_name);
+    if (symlink(slave_name, link_name) < 0) { perror(link_name); return 1; }
+  }
+  printf("%s\n", link_name ? link_name : slave_name);
+  fflush(stdout);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  sim::reset();
+  target.configure(*part);
+  sim::linkFd = master;
+  if (trace) sim::linkTap = record;
+  setup();
+  try {
+    while (!stop) loop();
+  } catch (sim::Timeout &) {
+  }
+  finish();
+  return 0;
+}
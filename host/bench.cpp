@@ -0,0 +1,300 @@
+// Replays recorded STK500 sessions (traces.py writes the standard set, asm_isp -r records new ones)
+// and reports how long each command took and where the time went.
+//
+//   bench [-p m328p|m2560|m8a|t85] trace...          against the simulated UNO and target
+//   bench -P port [-b baud] trace...                 against a real programmer, or asm_isp's pty
+//
+// Each frame is sent once the reply to the one before it is in, as avrdude does.  The latency of
+// a command runs from its first byte leaving the host to the last byte of its reply arriving, so
+// it takes in both directions of the serial link.  In the simulation it's all on the virtual
+// clock, so a run gives the same numbers every time and a change shows up as a change in them;
+// the UNO's time is also split into SPI transfers, waiting on the host, waiting for room in the
+// transmit buffer and delay() (resets and write timeouts), the rest being the sketch itself.
+// Over a port it's wall clock time, and the split isn't available.
+//
+// Exits non-zero if any reply doesn't match the trace ("??" matches anything).
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <Arduino.h>
+#include "sim.h"
+#include "target.h"
+
+void setup(); void loop();
+
+struct Exchange {
+  std::vector<uint8_t> send;
+  std::vector<int> reply;     // -1 for "??"
+  double wait_ms;             // host pause before sending
+};
+
+static bool load(const char *name, std::vector<Exchange> &trace) {
+  FILE *f = fopen(name, "r");
+  if (!f) { perror(name); return false; }
+  char line[4096];
+  double wait_ms = 0;
+  while (fgets(line, sizeof line, f)) {
+    if (line[0] == '.') { wait_ms += atof(line + 1); continue; }
+    if (line[0] != '>' && line[0] != '<') continue;
+    std::vector<int> b;
+    for (char *p = strtok(line + 1, " \t\r\n"); p; p = strtok(NULL, " \t\r\n"))
+      b.push_back(strcmp(p, "??") == 0 ? -1 : (int)strtol(p, NULL, 16));
+    if (line[0] == '>' && !b.empty()) {
+      trace.push_back(Exchange());
+      trace.back().send.assign(b.begin(), b.end());
+      trace.back().wait_ms = wait_ms;
+      wait_ms = 0;
+    } else if (!trace.empty() && !trace.back().send.empty()) {
+      trace.back().reply.insert(trace.back().reply.end(), b.begin(), b.end());
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+// latency histogram buckets, in ms: <0.25, <0.5, <1 ... <64, and the rest
+#define BUCKETS 10
+static const double bucket_ms[BUCKETS - 1] = { 0.25, 0.5, 1, 2, 4, 8, 16, 32, 64 };
+
+struct CommandStats {
+  uint32_t count;
+  double total, min, max;     // ms
+  uint32_t hist[BUCKETS];
+};
+
+static const char *command_name(uint8_t c) {
+  switch (c) {
+    case 0x30: return "GET_SYNC";
+    case 0x31: return "GET_SIGN_ON";
+    case 0x40: return "SET_PARAMETER";
+    case 0x41: return "GET_PARAMETER";
+    case 0x42: return "SET_DEVICE";
+    case 0x45: return "SET_DEVICE_EXT";
+    case 0x50: return "ENTER_PROGMODE";
+    case 0x51: return "LEAVE_PROGMODE";
+    case 0x52: return "CHIP_ERASE";
+    case 0x55: return "LOAD_ADDRESS";
+    case 0x56: return "UNIVERSAL";
+    case 0x64: return "PROG_PAGE";
+    case 0x74: return "READ_PAGE";
+    case 0x75: return "READ_SIGN";
+    case 0x80: return "CHECKSUM";
+    case 0x81: return "VERIFY_PAGE";
+    case 0x82: return "VERIFY_RESULT";
+    case 0x83: return "PAGE_COUNTS";
+    case 0x84: return "PROG_PACKED";
+    case 0x85: return "UNIVERSAL_BATCH";
+    case 0x8A: return "SERIAL_SET";
+    case 0x8B: return "SERIAL_GET";
+    case 0x8C: return "PERF_GET";
+    default:   return "";
+  }
+}
+
+struct Run {
+  CommandStats cmd[256];
+  uint64_t bytes_out, bytes_in;
+  uint32_t mismatches;
+  double total_ms;
+  double uart_ms, spi_ms, delay_ms, host_ms;  // simulation only
+  Target target;
+  uint32_t overruns;
+};
+
+static void record(Run &run, const Exchange &x, const std::vector<uint8_t> &got, double ms) {
+  CommandStats &c = run.cmd[x.send[0]];
+  if (c.count == 0 || ms < c.min) c.min = ms;
+  if (ms > c.max) c.max = ms;
+  c.count++;
+  c.total += ms;
+  int b = 0;
+  while (b < BUCKETS - 1 && ms >= bucket_ms[b]) b++;
+  c.hist[b]++;
+  run.bytes_out += x.send.size();
+  run.bytes_in += got.size();
+  bool same = got.size() == x.reply.size();
+  for (size_t i = 0; same && i < got.size(); i++) same = x.reply[i] < 0 || x.reply[i] == got[i];
+  if (!same) {
+    if (run.mismatches++ < 5) {
+      printf("  reply to %02x:", x.send[0]);
+      for (size_t i = 0; i < got.size(); i++) printf(" %02x", got[i]);
+      printf(", trace has");
+      for (size_t i = 0; i < x.reply.size(); i++) x.reply[i] < 0 ? printf(" ??") : printf(" %02x", x.reply[i]);
+      printf("\n");
+    }
+  }
+}
+
+static void report(const char *name, const Run &run) {
+  printf("%s: %zu B out, %zu B in, %.3f s, %.0f B/s\n", name, (size_t)run.bytes_out, (size_t)run.bytes_in,
+         run.total_ms / 1000, (run.bytes_out + run.bytes_in) / (run.total_ms / 1000));
+  printf("  %-20s %6s %9s %9s %9s   ms: <.25 <.5   <1   <2   <4   <8  <16  <32  <64 more\n",
+         "command", "count", "mean ms", "min", "max");
+  for (int c = 0; c < 256; c++) {
+    const CommandStats &s = run.cmd[c];
+    if (!s.count) continue;
+    printf("  %02x %-17s %6u %9.3f %9.3f %9.3f      ", c, command_name(c), s.count, s.total / s.count, s.min, s.max);
+    for (int b = 0; b < BUCKETS; b++) printf(" %4u", s.hist[b]);
+    printf("\n");
+  }
+  if (run.uart_ms || run.spi_ms) {
+    printf("  time: UART %.3f s, SPI %.3f s, delay() %.3f s, the sketch otherwise %.3f s, host pauses %.3f s\n",
+           run.uart_ms / 1000, run.spi_ms / 1000, run.delay_ms / 1000,
+           (run.total_ms - run.uart_ms - run.spi_ms - run.delay_ms - run.host_ms) / 1000, run.host_ms / 1000);
+    printf("  target: %u page writes, %u EEPROM writes, %u SPI bytes, %u instructions while busy; %u UART overruns\n",
+           run.target.pageWrites, run.target.eepromWrites, run.target.spiBytes, run.target.violations, run.overruns);
+  }
+}
+
+// in process, on the virtual clock
+
+static const double NS_MS = 1e6;
+
+static bool replay_sim(const std::vector<Exchange> &trace, const TargetConfig &part, Run &run) {
+  sim::reset();
+  target.configure(part);
+  setup();
+  uint64_t start = sim::now_ns, spi = sim::spi_ns, txw = sim::uart_wait_ns, delays = sim::delay_ns;
+  uint64_t rxw = sim::rx_wait_ns, host = 0, uart_out = 0;
+  std::vector<uint8_t> &rx = sim::hostReceived();
+  for (size_t i = 0; i < trace.size(); i++) {
+    const Exchange &x = trace[i];
+    // the host hears the last reply, maybe pauses, then sends -- the sketch just waits
+    uint64_t done = sim::hostDoneAt(), at = done + (uint64_t)(x.wait_ms * NS_MS);
+    if (done > sim::now_ns) uart_out += done - sim::now_ns;
+    if (at > sim::now_ns) {
+      host += at - (done > sim::now_ns ? done : sim::now_ns);
+      sim::advance(at - sim::now_ns);
+    }
+    rx.clear();
+    uint64_t sent = sim::now_ns;
+    sim::hostSend(x.send.data(), x.send.size());
+    sim::deadline_ns = sim::now_ns + 5000 * 1000000ULL;
+    try {
+      while (rx.size() < x.reply.size()) loop();
+    } catch (sim::Timeout &) {
+    }
+    sim::deadline_ns = ~0ULL;
+    record(run, x, rx, (sim::hostDoneAt() - sent) / NS_MS);
+  }
+  if (sim::hostDoneAt() > sim::now_ns) {
+    uart_out += sim::hostDoneAt() - sim::now_ns;
+    sim::advance(sim::hostDoneAt() - sim::now_ns);
+  }
+  run.total_ms = (sim::now_ns - start) / NS_MS;
+  // the UART's share: the sketch finding nothing to read, stuck on a full transmit buffer, and the
+  // tail of each reply still going out after it's done
+  run.uart_ms = (sim::rx_wait_ns - rxw + sim::uart_wait_ns - txw + uart_out) / NS_MS;
+  run.spi_ms = (sim::spi_ns - spi) / NS_MS;
+  run.delay_ms = (sim::delay_ns - delays) / NS_MS;
+  run.host_ms = host / NS_MS;
+  run.target = target;
+  run.overruns = sim::rxOverruns;
+  return true;
+}
+
+// over a serial port, on the wall clock
+
+static double now_ms() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static speed_t baud_flag(long baud) {
+  switch (baud) {
+    case 9600:   return B9600;
+    case 19200:  return B19200;
+    case 38400:  return B38400;
+    case 57600:  return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 500000: return B500000;
+    case 1000000:return B1000000;
+    default:     return B0;
+  }
+}
+
+static int open_port(const char *port, long baud) {
+  int fd = open(port, O_RDWR | O_NOCTTY);
+  if (fd < 0) { perror(port); return -1; }
+  struct termios t;
+  if (tcgetattr(fd, &t) == 0) {
+    cfmakeraw(&t);
+    if (baud_flag(baud) != B0) cfsetspeed(&t, baud_flag(baud));
+    tcsetattr(fd, TCSANOW, &t);
+  }
+  usleep(2000000);  // opening the port resets the UNO unless the reset catcher is switched in
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+static bool replay_port(int fd, const std::vector<Exchange> &trace, Run &run) {
+  double start = now_ms();
+  for (size_t i = 0; i < trace.size(); i++) {
+    const Exchange &x = trace[i];
+    if (x.wait_ms > 0) usleep(x.wait_ms * 1000);
+    double sent = now_ms();
+    if (write(fd, x.send.data(), x.send.size()) != (ssize_t)x.send.size()) { perror("write"); return false; }
+    std::vector<uint8_t> got;
+    while (got.size() < x.reply.size()) {
+      struct pollfd p = { fd, POLLIN, 0 };
+      if (poll(&p, 1, 5000) <= 0) break;
+      uint8_t b[512];
+      ssize_t n = read(fd, b, x.reply.size() - got.size());
+      if (n <= 0) break;
+      got.insert(got.end(), b, b + n);
+    }
+    record(run, x, got, now_ms() - sent);
+  }
+  run.total_ms = now_ms() - start;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const TargetConfig *part = &ATMEGA328P;
+  const char *port = NULL;
+  long baud = 19200;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:P:b:")) != -1) {
+    switch (opt) {
+      case 'p':
+        if      (!strcmp(optarg, "m328p")) part = &ATMEGA328P;
+        else if (!strcmp(optarg, "m2560")) part = &ATMEGA2560;
+        else if (!strcmp(optarg, "m8a"))   part = &ATMEGA8A;
+        else if (!strcmp(optarg, "t85"))   part = &ATTINY85;
+        else { fprintf(stderr, "unknown part %s\n", optarg); return 2; }
+        break;
+      case 'P': port = optarg; break;
+      case 'b': baud = atol(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-p m328p|m2560|m8a|t85] [-P port [-b baud]] trace...\n", argv[0]);
+        return 2;
+    }
+  }
+  int fd = -1;
+  if (port && (fd = open_port(port, baud)) < 0) return 1;
+
+  uint32_t mismatches = 0;
+  for (int i = optind; i < argc; i++) {
+    std::vector<Exchange> trace;
+    if (!load(argv[i], trace)) return 1;
+    static Run run;
+    run = Run();
+    std::string name = argv[i];
+    name = name.substr(name.find_last_of('/') + 1);
+    bool ok = port ? replay_port(fd, trace, run) : replay_sim(trace, *part, run);
+    report(name.c_str(), run);
+    if (!ok) return 1;
+    if (run.mismatches) printf("  %u replies didn't match\n", run.mismatches);
+    mismatches += run.mismatches;
+  }
+  return mismatches != 0;
+}
@@ -0,0 +1,22 @@
+// FastPin's ATmega328P port map, checked against plain registers
+#define __AVR_ATmega328P__
+#include "FastPin.h"
+#include <cstdio>
+volatile uint8_t DDRB, PORTB, PINB, DDRC, PORTC, PINC, DDRD, PORTD, PIND;
+static int fails;
+template <uint8_t p> void check(volatile uint8_t &port, volatile uint8_t &ddr, volatile uint8_t &pin, uint8_t bit) {
+  DDRB = PORTB = PINB = DDRC = PORTC = PINC = DDRD = PORTD = PIND = 0;
+  FastPin<p>::high(); FastPin<p>::output();
+  if (port != (1 << bit) || ddr != (1 << bit) || (PORTB | PORTC | PORTD) != (1 << bit)) { printf("pin %d write wrong\n", p); fails++; }
+  FastPin<p>::input();
+  if (port || ddr) { printf("pin %d input wrong\n", p); fails++; }
+  pin = 1 << bit;
+  if (FastPin<p>::read() != HIGH) { printf("pin %d read wrong\n", p); fails++; }
+}
+int main() {
+  check<0>(PORTD, DDRD, PIND, 0); check<3>(PORTD, DDRD, PIND, 3); check<7>(PORTD, DDRD, PIND, 7);
+  check<8>(PORTB, DDRB, PINB, 0); check<10>(PORTB, DDRB, PINB, 2); check<13>(PORTB, DDRB, PINB, 5);
+  check<A0>(PORTC, DDRC, PINC, 0); check<A5>(PORTC, DDRC, PINC, 5);
+  printf(fails ? "FAIL\n" : "fastpin ok\n");
+  return fails != 0;
+}
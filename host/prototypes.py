@@ -0,0 +1,15 @@
+#!/usr/bin/env python3
+# Generate the function prototypes the Arduino builder would insert for a sketch
+import re, sys
+src = open(sys.argv[1]).read()
+src = re.sub(r'//[^\n]*|/\*.*?\*/|"(?:\\.|[^"\\])*"|\'(?:\\.|[^\'\\])*\'',
+             lambda m: '""' if m.group(0)[0] == '"' else ('0' if m.group(0)[0] == "'" else ' '), src, flags=re.S)
+out = []
+for m in re.finditer(r'^([A-Za-z_][\w \t\*&:<>]*?[\s\*&])(\w+)\s*\(([^;{)]*)\)\s*\{', src, re.M):
+    ret, name, args = m.group(1).strip(), m.group(2), ' '.join(m.group(3).split())
+    if ret in ('else', 'return', 'switch', 'if', 'while', 'for', 'do') or name in ('if','while','for','switch'):
+        continue
+    if ret.startswith(('struct', 'class', 'typedef', 'enum', 'template', 'static inline', 'inline', 'ISR')):
+        continue
+    out.append('%s %s(%s);' % (ret, name, args))
+print('\n'.join(out))
@@ -0,0 +1,391 @@
+// The Arduino core stand-in: a virtual clock that every call moves on by roughly what it costs on
+// a 16MHz UNO, the port registers, a UART with its timing and 64 byte buffers, and SPI wired to
+// the target model.  SIM_GANG puts four targets on the bus, SIM_STAMP an SPI flash chip on the
+// stamp pins.
+#include <cstdio>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <Arduino.h>
+#include <SPI.h>
+#include <avr/wdt.h>
+#include "sim.h"
+#include "target.h"
+
+volatile uint8_t DDRB, PORTB, PINB, DDRC, PORTC, PINC, DDRD, PORTD, PIND;
+volatile uint8_t OCR2A, OCR2B, TCCR2A, TCCR2B, TCNT2, MCUSR;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t ICR1, OCR1A;
+void TIMER1_OVF_vect(void);
+static bool masked, inIsr;
+static uint64_t nextTick;
+void noInterrupts() { masked = true; }
+void interrupts() { masked = false; }
+
+HardwareSerial Serial;
+SPIClass SPI;
+
+namespace sim {
+  uint64_t now_ns = 0;
+  uint64_t deadline_ns = ~0ULL;
+  uint8_t  spiDiv = 4;
+  bool     spiEnabled = false;
+  uint32_t baud = 19200;
+  uint64_t spi_ns = 0, uart_wait_ns = 0;
+  uint64_t delay_ns = 0, rx_wait_ns = 0;
+  static bool starved;                      // the sketch last looked at Serial and found nothing
+  uint32_t rxOverruns = 0;
+  bool     pinInput[20];
+  uint8_t  ownEeprom[1024];
+  int      linkFd = -1;
+  void   (*linkTap)(bool, const uint8_t *, size_t);
+
+  struct Pending { uint8_t b; uint64_t at; };
+  static std::deque<Pending> rxFlight;      // on the wire towards the sketch
+  static std::deque<uint8_t> rxBuf;         // HardwareSerial's receive ring
+  static std::deque<uint64_t> txBuf;        // completion time of each queued tx byte
+  static uint64_t rxLast = 0, txLast = 0;
+  static std::vector<uint8_t> received;
+
+  static const size_t SERIAL_BUF = 64;
+
+  uint64_t byteTime() { return 10ULL * 1000000000ULL / baud; }
+
+  std::deque<Step> script;
+  bool stopWhenIdle = false;
+  std::vector<std::vector<uint8_t> > scriptReplies;
+  static size_t scriptBase; static bool scriptSent = false;
+  static void scriptUpdate();
+
+  static void uartUpdate() {
+    while (!rxFlight.empty() && rxFlight.front().at <= now_ns) {
+      if (rxBuf.size() < SERIAL_BUF - 1) rxBuf.push_back(rxFlight.front().b);
+      else rxOverruns++;
+      rxFlight.pop_front();
+    }
+    while (!txBuf.empty() && txBuf.front() <= now_ns) txBuf.pop_front();
+    scriptUpdate();
+  }
+
+  // a host that sends each frame once the reply to the previous one has arrived, like avrdude
+  static void scriptUpdate() {
+    while (!script.empty()) {
+      if (!scriptSent) {
+        scriptBase = received.size();
+        hostSend(script.front().frame.data(), script.front().frame.size());
+        scriptSent = true;
+      }
+      size_t delivered = received.size() - txBuf.size();
+      if (delivered < scriptBase + script.front().reply) return;
+      scriptReplies.push_back(std::vector<uint8_t>(received.begin() + scriptBase, received.begin() + scriptBase + script.front().reply));
+      script.pop_front();
+      scriptSent = false;
+    }
+  }
+
+  uint32_t timerTicks;
+  void advance(uint64_t ns) {
+    now_ns += ns;
+    if (starved) rx_wait_ns += ns;
+    // Timer1 overflow, every (ICR1 + 1) clk/8 cycles, costing about 2us each
+    if ((TIMSK1 & 1) && !masked && !inIsr && (TCCR1B & 7) == 2) {
+      uint64_t period = (ICR1 + 1) * 500ULL;
+      if (nextTick == 0) nextTick = now_ns - ns + period;
+      while (now_ns >= nextTick) {
+        nextTick += period;
+        inIsr = true;
+        timerTicks++;
+        TIMER1_OVF_vect();
+        now_ns += 2000;
+        inIsr = false;
+      }
+    }
+    uartUpdate();
+    if (now_ns > deadline_ns && !inIsr) throw Timeout();
+  }
+
+  void reset() {
+    now_ns = 0; spi_ns = uart_wait_ns = delay_ns = rx_wait_ns = 0; starved = false; rxOverruns = 0;
+    rxFlight.clear(); rxBuf.clear(); txBuf.clear(); received.clear();
+    rxLast = txLast = 0;
+    script.clear(); scriptReplies.clear(); scriptSent = false;
+    for (int i = 0; i < 20; i++) pinInput[i] = true;
+    DDRB = PORTB = DDRC = PORTC = DDRD = PORTD = 0;
+    TCCR1A = TCCR1B = TIMSK1 = 0; nextTick = 0; masked = inIsr = false;
+  }
+
+  uint64_t hostSend(const uint8_t *b, size_t n) {
+    uint64_t t = rxLast > now_ns ? rxLast : now_ns;
+    for (size_t i = 0; i < n; i++) {
+      t += byteTime();
+      rxFlight.push_back({ b[i], t });
+    }
+    rxLast = t;
+    return t;
+  }
+
+  std::vector<uint8_t> &hostReceived() { return received; }
+  uint64_t hostDoneAt() { return txLast; }
+  bool rxIdle() { return rxFlight.empty(); }
+
+  static volatile uint8_t *portOf(uint8_t pin, volatile uint8_t **ddr) {
+    if (pin < 8)  { *ddr = &DDRD; return &PORTD; }
+    if (pin < 14) { *ddr = &DDRB; return &PORTB; }
+    *ddr = &DDRC; return &PORTC;
+  }
+  static uint8_t bitOf(uint8_t pin) {
+    if (pin < 8) return 1 << pin;
+    if (pin < 14) return 1 << (pin - 8);
+    return 1 << (pin - 14);
+  }
+
+  uint32_t clockOut() {
+    static const uint16_t pre[] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+    if (!(TCCR2A & (1 << COM2B0)) || !(TCCR2B & 7)) return 0;
+    return F_CPU / 2 / pre[TCCR2B & 7] / (OCR2A + 1);
+  }
+
+  bool pinLevel(uint8_t pin) {
+    volatile uint8_t *ddr, *port = portOf(pin, &ddr);
+    if (*ddr & bitOf(pin)) return *port & bitOf(pin);
+    return pinInput[pin];
+  }
+}
+
+// time an avr instruction stream takes is folded into these
+void delay(unsigned long ms) { sim::starved = false; sim::delay_ns += ms * 1000000ULL; sim::advance(ms * 1000000ULL); }
+void delayMicroseconds(unsigned int us) { sim::starved = false; sim::delay_ns += us * 1000ULL; sim::advance(us * 1000ULL); }
+unsigned long millis() { sim::advance(1000); return sim::now_ns / 1000000ULL; }  // ~16 cycles a call
+unsigned long micros() { sim::advance(1000); return sim::now_ns / 1000ULL; }
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  volatile uint8_t *ddr, *port = sim::portOf(pin, &ddr);
+  if (mode == OUTPUT) *ddr |= sim::bitOf(pin);
+  else {
+    *ddr &= ~sim::bitOf(pin);
+    if (mode == INPUT_PULLUP) *port |= sim::bitOf(pin); else *port &= ~sim::bitOf(pin);
+  }
+  sim::advance(4000);
+}
+#ifdef SIM_STAMP
+// 25 series SPI flash on the stamp pins: CS A1, SCK A2, MOSI A3, MISO A4
+namespace sim {
+  std::vector<uint8_t> storage(1 << 20, 0xFF);
+  uint64_t buttonUntil;
+  std::vector<std::pair<uint64_t, uint64_t> > buttonBounces;
+  bool storageStuck;
+}
+static bool buttonDown() {
+  if (sim::now_ns < sim::buttonUntil) return true;
+  for (auto &b : sim::buttonBounces) if (sim::now_ns >= b.first && sim::now_ns < b.second) return true;
+  return false;
+}
+
+static struct { bool cs, wel, miso; int bit, n; uint8_t in, out, cmd; uint32_t addr; uint64_t busyUntil; } sf;
+static void sfByte(uint8_t b) {
+  bool busy = sim::now_ns < sf.busyUntil;
+  if (sf.n == 0) {
+    sf.cmd = b;
+    if (b == 0x06 && !busy) sf.wel = true;
+  } else if (sf.n <= 3) {
+    sf.addr = (sf.addr << 8) | b;
+  } else if (sf.cmd == 0x02 && sf.wel && !busy) {
+    uint32_t a = (sf.addr & ~0xFFu) | ((sf.addr + sf.n - 4) & 0xFF);
+    sim::storage[a % sim::storage.size()] &= b;
+  }
+  if (sf.cmd == 0x05) sf.out = (busy || sim::storageStuck) ? 1 : 0;
+  if (sf.cmd == 0x03 && sf.n >= 3) sf.out = sim::storage[(sf.addr + sf.n - 3) % sim::storage.size()];
+  sf.n++;
+}
+static void sfPin(uint8_t pin, uint8_t val) {
+  if (pin == A1) {
+    if (!val && !sf.cs) { sf.cs = true; sf.n = sf.bit = 0; sf.in = 0; sf.out = 0xFF; sf.addr = 0; }
+    if (val && sf.cs) {
+      sf.cs = false;
+      bool busy = sim::now_ns < sf.busyUntil;
+      if (sf.cmd == 0x02 && sf.wel && !busy && sf.n > 4) { sf.busyUntil = sim::now_ns + 700000; sf.wel = false; }
+      if (sf.cmd == 0xD8 && sf.wel && !busy && sf.n == 4) {
+        uint32_t a = sf.addr & ~0xFFFFu;
+        for (uint32_t i = 0; i < 0x10000; i++) sim::storage[(a + i) % sim::storage.size()] = 0xFF;
+        sf.busyUntil = sim::now_ns + 150000000ULL; sf.wel = false;
+      }
+    }
+  }
+  if (pin == A2 && val && sf.cs) {
+    sf.in = (sf.in << 1) | (sim::pinLevel(A3) ? 1 : 0);
+    sf.miso = (sf.out >> (7 - sf.bit)) & 1;
+    if (++sf.bit == 8) { sf.bit = 0; sfByte(sf.in); }
+  }
+}
+#endif
+
+#ifdef SIM_GANG
+static void gangPin(uint8_t pin, uint8_t val);
+#endif
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  volatile uint8_t *ddr, *port = sim::portOf(pin, &ddr);
+  if (val) *port |= sim::bitOf(pin); else *port &= ~sim::bitOf(pin);
+  sim::advance(4000);
+#ifdef SIM_STAMP
+  sfPin(pin, val);
+#endif
+#ifdef SIM_GANG
+  gangPin(pin, val);
+#endif
+}
+int digitalRead(uint8_t pin) {
+  sim::advance(3000);
+#ifdef SIM_STAMP
+  if (pin == A4) return sf.miso ? HIGH : LOW;
+  if (pin == A5) return buttonDown() ? LOW : HIGH;
+#endif
+  return sim::pinLevel(pin) ? HIGH : LOW;
+}
+void analogWrite(uint8_t, int) { sim::advance(6000); }
+
+void wdt_enable(int) { }
+void wdt_disable() { }
+
+// HardwareSerial, with a 64 byte receive and transmit buffer each like the real thing
+
+// link mode: take what the host has sent, waiting up to a millisecond (of both clocks) for it
+static void linkRead() {
+  uint8_t b[sim::SERIAL_BUF];
+  ssize_t n = read(sim::linkFd, b, sim::SERIAL_BUF - 1 - sim::rxBuf.size());
+  if (n > 0) {
+    sim::rxBuf.insert(sim::rxBuf.end(), b, b + n);
+    if (sim::linkTap) sim::linkTap(true, b, n);
+  } else if (sim::rxBuf.empty()) {
+    struct pollfd p = { sim::linkFd, POLLIN, 0 };
+    poll(&p, 1, 1);
+    sim::advance(1000000);
+  }
+}
+
+void HardwareSerial::begin(unsigned long b) { sim::baud = (getenv("BAUD") && b == 19200) ? atol(getenv("BAUD")) : b; }
+int HardwareSerial::available() {
+  sim::advance(500);
+  if (sim::linkFd >= 0) {
+    linkRead();
+    return sim::rxBuf.size();
+  }
+  sim::uartUpdate();
+  if (sim::stopWhenIdle && sim::script.empty() && sim::rxFlight.empty() && sim::rxBuf.empty()) throw sim::Idle();
+  sim::starved = sim::rxBuf.empty();
+  return sim::rxBuf.size();
+}
+int HardwareSerial::availableForWrite() {
+  sim::advance(500);
+  sim::uartUpdate();
+  int room = sim::SERIAL_BUF - 1 - sim::txBuf.size();
+  if (!room) sim::uart_wait_ns += 500;  // a sketch polling this is waiting on the UART too
+  return room;
+}
+int HardwareSerial::read() {
+  sim::uartUpdate();
+  if (sim::rxBuf.empty()) return -1;
+  int c = sim::rxBuf.front(); sim::rxBuf.pop_front();
+  sim::advance(500);
+  return c;
+}
+int HardwareSerial::peek() { sim::uartUpdate(); return sim::rxBuf.empty() ? -1 : sim::rxBuf.front(); }
+void HardwareSerial::flush() {
+  while (!sim::txBuf.empty()) {
+    uint64_t w = sim::txBuf.back() - sim::now_ns;
+    sim::uart_wait_ns += w;
+    sim::advance(w);
+  }
+}
+size_t HardwareSerial::write(uint8_t b) {
+  sim::starved = false;
+  if (sim::linkFd >= 0) {
+    while (::write(sim::linkFd, &b, 1) != 1 && (errno == EAGAIN || errno == EINTR)) poll(NULL, 0, 1);
+    if (sim::linkTap) sim::linkTap(false, &b, 1);
+    sim::advance(600);
+    return 1;
+  }
+  sim::uartUpdate();
+  while (sim::txBuf.size() >= sim::SERIAL_BUF - 1) {
+    uint64_t w = sim::txBuf.front() - sim::now_ns;
+    sim::uart_wait_ns += w;
+    sim::advance(w);
+  }
+  uint64_t start = sim::txLast > sim::now_ns ? sim::txLast : sim::now_ns;
+  sim::txLast = start + sim::byteTime();
+  sim::txBuf.push_back(sim::txLast);
+  sim::received.push_back(b);
+  sim::advance(600);
+  return 1;
+}
+size_t HardwareSerial::write(const char *s) { size_t n = 0; while (*s) n += write((uint8_t)*s++); return n; }
+size_t HardwareSerial::write(const uint8_t *b, size_t n) { for (size_t i = 0; i < n; i++) write(b[i]); return n; }
+size_t HardwareSerial::print(const char *s) { return write(s); }
+size_t HardwareSerial::print(unsigned long n, int base) {
+  char buf[34]; char *p = buf + 33; *p = 0;
+  do { int d = n % base; *--p = d < 10 ? '0' + d : 'A' + d - 10; n /= base; } while (n);
+  return write(p);
+}
+size_t HardwareSerial::print(long n, int base) {
+  size_t c = 0;
+  if (n < 0 && base == DEC) { c = write('-'); n = -n; }
+  return c + print((unsigned long)n, base);
+}
+
+// SPI goes straight to the target model
+
+static const uint8_t divs[] = { 4, 16, 64, 128, 2, 8, 32 };
+void SPIClass::begin() {
+  if (!(DDRB & (1 << 2))) PORTB |= (1 << 2);
+  DDRB |= (1 << 2) | (1 << 3) | (1 << 5);
+  sim::spiEnabled = true;
+}
+void SPIClass::end() { sim::spiEnabled = false; }
+void SPIClass::setClockDivider(uint8_t div) { sim::spiDiv = divs[div & 7]; }
+volatile uint8_t SPSR = 1 << SPIF;
+SpdrReg SPDR;
+static uint8_t spdrIn = 0xFF;
+#ifdef SIM_GANG
+// target on SS plus gangTargets[] on 2, 4, 5: everyone hears MOSI, MISO comes through the buffer
+// selected by A1..A4 (low), and two selected at once is contention
+Target gangTargets[3];
+static uint8_t ispXfer(uint8_t b, uint32_t hz) {
+  static const uint8_t resets[4] = { SS, 2, 4, 5 }, selects[4] = { A1, A2, A3, A4 };
+  int out = -1; bool clash = false;
+  for (int i = 0; i < 4; i++) {
+    Target &t = i ? gangTargets[i - 1] : target;
+    uint8_t r = t.xfer(b, hz, sim::pinLevel(resets[i]));
+    if (!sim::pinLevel(selects[i])) { if (out >= 0) clash = true; out = r; }
+  }
+  return clash ? 0x5A : out < 0 ? 0xFF : out;
+}
+// a target sees RESET go high even when no SPI byte goes by before it's low again
+static void gangPin(uint8_t pin, uint8_t val) {
+  static const uint8_t resets[4] = { SS, 2, 4, 5 };
+  for (int i = 0; i < 4; i++) {
+    if (pin == resets[i] && val) (i ? gangTargets[i - 1] : target).xfer(0xFF, 0, true);
+  }
+}
+#else
+static uint8_t ispXfer(uint8_t b, uint32_t hz) { return target.xfer(b, hz, sim::pinLevel(SS)); }
+#endif
+// streaming: a few cycles between bytes rather than the library call's dozen
+SpdrReg &SpdrReg::operator=(uint8_t b) {
+  uint64_t ns = (8ULL * sim::spiDiv + 4) * 1000000000ULL / F_CPU;
+  sim::starved = false;
+  sim::spi_ns += ns;
+  sim::advance(ns);
+  spdrIn = sim::spiEnabled ? ispXfer(b, F_CPU / sim::spiDiv) : 0xFF;
+  return *this;
+}
+SpdrReg::operator uint8_t() const { return spdrIn; }
+
+uint8_t SPIClass::transfer(uint8_t data) {
+  uint64_t ns = (8ULL * sim::spiDiv + 12) * 1000000000ULL / F_CPU;
+  sim::starved = false;
+  sim::spi_ns += ns;
+  sim::advance(ns);
+  if (!sim::spiEnabled) return 0xFF;
+  return ispXfer(data, F_CPU / sim::spiDiv);
+}
@@ -0,0 +1,53 @@
+// Virtual clock, pins and serial link shared by the Arduino stand-in and the harness
+#ifndef _HOST_SIM_H
+#define _HOST_SIM_H
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <utility>
+#include <deque>
+
+namespace sim {
+  extern uint64_t now_ns;
+  extern uint8_t  spiDiv;           // SPI clock divider currently selected
+  extern bool     spiEnabled;
+  extern uint32_t baud;
+  extern uint64_t spi_ns, uart_wait_ns;
+  extern uint64_t delay_ns;         // in delay() and delayMicroseconds()
+  extern uint64_t rx_wait_ns;       // from finding nothing in Serial to doing something else
+  extern uint32_t rxOverruns;
+  extern bool     pinInput[20];     // level seen on input pins
+
+  extern uint64_t deadline_ns;     // advance() throws Timeout past this
+  struct Timeout {};
+  void advance(uint64_t ns);
+  void reset();
+
+  // host side of the serial link
+  uint64_t hostSend(const uint8_t *b, size_t n);  // returns when the last byte will have arrived
+  std::vector<uint8_t> &hostReceived();
+  uint64_t hostDoneAt();             // when the last of hostReceived() is through the UART
+  struct Step { std::vector<uint8_t> frame; size_t reply; };
+  extern std::deque<Step> script;    // frames sent back to back as replies arrive
+  extern std::vector<std::vector<uint8_t> > scriptReplies;
+  struct Idle {};                    // thrown by Serial.available() once the script is done
+  extern bool stopWhenIdle;
+  bool rxIdle();                     // nothing left in flight towards the sketch
+
+  bool pinLevel(uint8_t pin);        // output level of a pin, or what's driving it if it's an input
+  uint32_t clockOut();               // frequency Timer2 generates on OC2B, 0 if stopped
+  extern uint32_t timerTicks;        // Timer1 overflow interrupts taken
+  extern uint8_t  ownEeprom[1024];   // the programmer's own EEPROM, kept across reset()
+#ifdef SIM_STAMP
+  extern std::vector<uint8_t> storage;  // the stamp mode SPI flash chip
+  extern uint64_t buttonUntil;       // STAMP_BUTTON reads low until then
+  extern std::vector<std::pair<uint64_t, uint64_t> > buttonBounces;  // and low again in each of these
+  extern bool storageStuck;          // the storage chip reads busy forever
+#endif
+
+  // Serial on a real file descriptor (a pty, see asm_isp.cpp) instead of the modeled UART --
+  // bytes go straight through, and the virtual clock keeps up with real time while it's idle
+  extern int linkFd;
+  extern void (*linkTap)(bool fromHost, const uint8_t *b, size_t n);  // sees the link's traffic
+}
+#endif
@@ -0,0 +1,4 @@
+// Compile the sketch the way the Arduino builder would: core header, prototypes, then the .ino
+#include <Arduino.h>
+#include "prototypes.h"
+#include "sketch.ino.cpp"
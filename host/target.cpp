@@ -0,0 +1,152 @@
+#include "target.h"
+#include "sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+const TargetConfig ATMEGA328P = { { 0x1E, 0x95, 0x0F },  32 * 1024, 128, 1024, 4, false, 16000000, 4500, 3600, 9000, 4500 };
+const TargetConfig ATMEGA2560 = { { 0x1E, 0x98, 0x01 }, 256 * 1024, 256, 4096, 8, false, 16000000, 4500, 3600, 9000, 4500 };
+const TargetConfig ATMEGA8A   = { { 0x1E, 0x93, 0x07 },   8 * 1024,  64,  512, 0, true,  16000000, 4500, 9000, 9000, 4500 };
+const TargetConfig BARE_M328 = { { 0x1E, 0x95, 0x0F },  32 * 1024, 128, 1024, 4, false, 0, 4500, 3600, 9000, 4500 };
+const TargetConfig ATTINY85   = { { 0x1E, 0x93, 0x0B },   8 * 1024,  64,  512, 4, false,  1000000, 4500, 4000, 9000, 4500 };
+
+Target target;
+
+Target::Target() { configure(ATMEGA328P); }
+
+void Target::configure(const TargetConfig &c) {
+  cfg = c;
+  flash.assign(cfg.flashSize, 0xFF);
+  eeprom.assign(cfg.eepromSize, 0xFF);
+  fuses[0] = 0x62; fuses[1] = 0xD9; fuses[2] = 0xFF; lock = 0xFF; cal = 0x9A;
+  violations = pageWrites = eepromWrites = spiBytes = desyncs = 0;
+  powerOn();
+}
+
+void Target::powerOn() {
+  inReset = false; enabled = false; idx = 0; ext = 0; busyUntil = 0;
+  pageBuf.assign(cfg.flashPage, 0xFF);
+  eepromBuf.assign(cfg.eepromPage ? cfg.eepromPage : 1, 0xFF);
+  eepromLoaded.assign(eepromBuf.size(), false);
+}
+
+bool Target::busy() const { return sim::now_ns < busyUntil; }
+
+void Target::setBusy(uint32_t us) { busyUntil = sim::now_ns + (uint64_t)us * 1000; }
+
+uint8_t Target::xfer(uint8_t in, uint32_t sckHz, bool reset) {
+  if (reset) {                       // running, not listening
+    inReset = false; enabled = false; idx = 0; ext = 0;
+    return 0xFF;
+  }
+  if (!inReset) {                    // RESET just went low
+    inReset = true; enabled = false; idx = 0; ext = 0;
+    pageBuf.assign(pageBuf.size(), 0xFF);
+  }
+  spiBytes++;
+  // SCK high and low phases must each last more than 2 target clocks, 3 at 12MHz and up
+  uint32_t clk = cfg.clockHz ? cfg.clockHz : sim::clockOut();
+  if (clk == 0 || sckHz > clk / (clk >= 12000000 ? 6 : 4)) {
+    desyncs++;
+    idx = (idx + 1) & 3;
+    return (uint8_t)(in * 7 + spiBytes);
+  }
+  uint8_t out = 0;
+  cmd[idx] = in;
+  if (!enabled) {
+    if (idx == 2) out = (cmd[0] == 0xAC && cmd[1] == 0x53) ? 0x53 : cmd[1] ^ 0xFF;
+    if (idx == 3) {
+      if (cmd[0] == 0xAC && cmd[1] == 0x53) enabled = true;
+      idx = 0;
+      return out;
+    }
+    idx++;
+    return out;
+  }
+  if (idx == 1) out = cmd[0];
+  if (idx == 2) out = cmd[1];
+  if (idx == 3) { out = execute(); idx = 0; return out; }
+  idx++;
+  return out;
+}
+
+uint8_t Target::execute() {
+  uint8_t c = cmd[0];
+  bool isPoll = (c == 0xF0);
+  if (busy() && !isPoll) {
+    // reads during a write return the busy pattern; anything else is a programmer bug
+    if (c == 0x20 || c == 0x28 || c == 0xA0) return 0xFF;
+    violations++;
+    return 0xFF;
+  }
+  uint32_t word = ((uint32_t)ext << 16) | (cmd[1] << 8) | cmd[2];
+  uint16_t wordsPerPage = cfg.flashPage / 2;
+  switch (c) {
+    case 0xF0: return cfg.timedWrites ? 0x00 : (busy() ? 0x01 : 0x00);
+    case 0xAC:
+      switch (cmd[1]) {
+        case 0x80:
+          flash.assign(flash.size(), 0xFF);
+          eeprom.assign(eeprom.size(), 0xFF);
+          lock = 0xFF;
+          setBusy(cfg.twdEraseUs);
+          break;
+        case 0xA0: fuses[0] = cmd[3]; setBusy(cfg.twdFuseUs); break;
+        case 0xA8: fuses[1] = cmd[3]; setBusy(cfg.twdFuseUs); break;
+        case 0xA4: fuses[2] = cmd[3]; setBusy(cfg.twdFuseUs); break;
+        case 0xE0: lock = cmd[3];     setBusy(cfg.twdFuseUs); break;
+      }
+      return cmd[2];
+    case 0x50: return cmd[1] == 0x08 ? fuses[2] : fuses[0];
+    case 0x58: return cmd[1] == 0x08 ? fuses[1] : lock;
+    case 0x38: return cal;
+    case 0x30: return cmd[2] < 3 ? cfg.sig[cmd[2]] : 0xFF;
+    case 0x4D: ext = cmd[2]; return 0;
+    case 0x40: case 0x48: {
+      uint16_t w = cmd[2] % wordsPerPage;
+      pageBuf[w * 2 + (c == 0x48)] = cmd[3];
+      return 0;
+    }
+    case 0x4C: {
+      uint32_t base = (word - word % wordsPerPage) * 2;
+      if (base < flash.size())
+        for (uint16_t i = 0; i < cfg.flashPage; i++) flash[base + i] &= pageBuf[i];
+      pageBuf.assign(pageBuf.size(), 0xFF);
+      pageWrites++;
+      setBusy(cfg.twdFlashUs);
+      return 0;
+    }
+    case 0x20: case 0x28: {
+      uint32_t a = word * 2 + (c == 0x28);
+      return a < flash.size() ? flash[a] : 0xFF;
+    }
+    case 0xA0: {
+      uint16_t a = (cmd[1] << 8) | cmd[2];
+      return a < eeprom.size() ? eeprom[a] : 0xFF;
+    }
+    case 0xC0: {
+      uint16_t a = (cmd[1] << 8) | cmd[2];
+      if (a < eeprom.size()) eeprom[a] = cmd[3];
+      eepromWrites++;
+      setBusy(cfg.twdEepromUs);
+      return 0;
+    }
+    case 0xC1:
+      if (cfg.eepromPage) {
+        uint8_t i = cmd[2] % cfg.eepromPage;
+        eepromBuf[i] = cmd[3]; eepromLoaded[i] = true;
+      }
+      return 0;
+    case 0xC2: {
+      if (!cfg.eepromPage) return 0;
+      uint16_t a = ((cmd[1] << 8) | cmd[2]);
+      a -= a % cfg.eepromPage;
+      for (uint8_t i = 0; i < cfg.eepromPage; i++)
+        if (eepromLoaded[i] && a + i < eeprom.size()) eeprom[a + i] = eepromBuf[i];
+      eepromLoaded.assign(eepromLoaded.size(), false);
+      eepromWrites++;
+      setBusy(cfg.twdEepromUs);
+      return 0;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,47 @@
+// In-memory AVR target answering the serial programming instruction set
+#ifndef _HOST_TARGET_H
+#define _HOST_TARGET_H
+#include <stdint.h>
+#include <vector>
+
+struct TargetConfig {
+  uint8_t  sig[3];
+  uint32_t flashSize;       // bytes
+  uint16_t flashPage;       // bytes
+  uint16_t eepromSize;      // bytes
+  uint8_t  eepromPage;      // bytes, 0 if no page mode
+  bool     timedWrites;     // Poll RDY/BSY not supported
+  uint32_t clockHz;         // target system clock, 0 if fed from CLOCK_OUT
+  uint32_t twdFlashUs, twdEepromUs, twdEraseUs, twdFuseUs;
+};
+
+extern const TargetConfig BARE_M328, ATMEGA328P, ATMEGA2560, ATMEGA8A, ATTINY85;
+
+class Target {
+public:
+  TargetConfig cfg;
+  std::vector<uint8_t> flash, eeprom;
+  uint8_t fuses[3], lock, cal;
+  // statistics / checks
+  uint32_t violations;       // instructions issued while busy (other than polling)
+  uint32_t pageWrites, eepromWrites, spiBytes, desyncs;
+
+  Target();
+  void configure(const TargetConfig &c);
+  void powerOn();
+  uint8_t xfer(uint8_t in, uint32_t sckHz, bool reset);
+  bool busy() const;
+
+private:
+  bool     inReset, enabled;
+  uint8_t  cmd[4], idx;
+  uint8_t  ext;
+  uint64_t busyUntil;
+  std::vector<uint8_t> pageBuf, eepromBuf;
+  std::vector<bool> eepromLoaded;
+  uint8_t execute();
+  void setBusy(uint32_t us);
+};
+
+extern Target target;
+#endif
@@ -0,0 +1,833 @@
+// Regression tests and timings: an in-process STK500 host driving the sketch against the target
+// model, on the virtual clock.  Built three ways (see the Makefile) -- plain, with SIM_GANG and
+// GANG_PROGRAMMING, and with SIM_STAMP and STAMP_MODE -- and each prints "all ok" or the failures.
+//
+// Knobs, from the environment:
+//   BAUD=n     serial rate in place of ISP_BAUD
+//   PIPE=0|1   pipelined writes for the part tests
+//   EEBLK=n    EEPROM block size for the part tests
+//   HDEBUG=1   dump replies that didn't end in STK_OK
+#include <stdlib.h>
+#include <Arduino.h>
+#include <stdio.h>
+#include <string>
+#include <assert.h>
+#include "sim.h"
+#include "target.h"
+
+void setup(); void loop();
+
+static int fails = 0;
+#define CHECK(c) do { if (!(c)) { printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #c); fails++; } } while (0)
+
+// send a frame, run the sketch until n reply bytes arrive
+static std::vector<uint8_t> cmd(std::vector<uint8_t> f, size_t n, uint64_t timeout_ms = 5000) {
+  std::vector<uint8_t> &rx = sim::hostReceived();
+  rx.clear();
+  sim::hostSend(f.data(), f.size());
+  sim::deadline_ns = sim::now_ns + timeout_ms * 1000000ULL;
+  try {
+    while (rx.size() < n) loop();
+  } catch (sim::Timeout &) {
+    printf("  timeout on command %02x (len %zu), got %zu of %zu reply bytes\n", f[0], f.size(), rx.size(), n);
+  }
+  sim::deadline_ns = ~0ULL;
+  return rx;
+}
+static bool ok(const std::vector<uint8_t> &r) { return r.size() >= 2 && r.front() == 0x14 && r.back() == 0x10; }
+
+static void setDevice(const TargetConfig &c) {
+  std::vector<uint8_t> f = { 0x42, 0x86, 0, 0, 1, 1, 1, 1, 3, 0xFF, 0xFF, 0xFF, 0xFF,
+                             (uint8_t)(c.flashPage >> 8), (uint8_t)c.flashPage,
+                             (uint8_t)(c.eepromSize >> 8), (uint8_t)c.eepromSize,
+                             (uint8_t)(c.flashSize >> 24), (uint8_t)(c.flashSize >> 16), (uint8_t)(c.flashSize >> 8), (uint8_t)c.flashSize, 0x20 };
+  CHECK(ok(cmd(f, 2)));
+  CHECK(ok(cmd({ 0x45, 0x05, c.eepromPage, 0xD7, 0xC2, 0x00, 0x20 }, 2)));
+}
+
+static void loadAddr(uint32_t word) {
+  if (target.cfg.flashSize > 128 * 1024) CHECK(ok(cmd({ 0x56, 0x4D, 0x00, (uint8_t)(word >> 16), 0x00, 0x20 }, 3)));
+  CHECK(ok(cmd({ 0x55, (uint8_t)word, (uint8_t)(word >> 8), 0x20 }, 2)));
+}
+
+// run the sketch until the host script is done and the sketch has gone idle
+static void runScript() {
+  sim::script.push_back({ { 0x30, 0x20 }, 2 });  // answered once the last page is written
+  sim::deadline_ns = sim::now_ns + 60000000000ULL;
+  sim::stopWhenIdle = true;
+  try {
+    for (;;) loop();
+  } catch (sim::Idle &) {
+  } catch (sim::Timeout &) {
+    printf("  timeout in host script, %zu frames left\n", sim::script.size());
+  }
+  sim::stopWhenIdle = false;
+  sim::deadline_ns = ~0ULL;
+}
+
+// scripted like avrdude's paged write, so the host reacts to each reply the moment it arrives
+static double writeFlash(const std::vector<uint8_t> &img, uint16_t page, uint32_t base = 0) {
+  uint64_t t0 = sim::now_ns;
+  for (uint32_t a = 0; a < img.size(); a += page) {
+    uint32_t word = (base + a) / 2;
+    if (target.cfg.flashSize > 128 * 1024) sim::script.push_back({ { 0x56, 0x4D, 0x00, (uint8_t)(word >> 16), 0x00, 0x20 }, 3 });
+    sim::script.push_back({ { 0x55, (uint8_t)word, (uint8_t)(word >> 8), 0x20 }, 2 });
+    std::vector<uint8_t> f = { 0x64, (uint8_t)(page >> 8), (uint8_t)page, 'F' };
+    f.insert(f.end(), img.begin() + a, img.begin() + a + page);
+    f.push_back(0x20);
+    sim::script.push_back({ f, 2 });
+  }
+  runScript();
+  for (auto &r : sim::scriptReplies) { CHECK(r.back() == 0x10); if (r.back() != 0x10 && getenv("HDEBUG")) { for (auto b : r) printf("%02x ", b); printf("\n"); } }
+  sim::scriptReplies.clear();
+  return (sim::now_ns - t0) / 1e9;
+}
+
+static double readTime = 0;
+static std::vector<uint8_t> readMem(char type, uint32_t size, uint16_t block, uint32_t base = 0) {
+  std::vector<uint8_t> out;
+  uint64_t t0 = sim::now_ns;
+  for (uint32_t a = 0; a < size; a += block) {
+    uint32_t word = (base + a) / 2;
+    if (target.cfg.flashSize > 128 * 1024) sim::script.push_back({ { 0x56, 0x4D, 0x00, (uint8_t)(word >> 16), 0x00, 0x20 }, 3 });
+    sim::script.push_back({ { 0x55, (uint8_t)word, (uint8_t)(word >> 8), 0x20 }, 2 });
+    sim::script.push_back({ { 0x74, (uint8_t)(block >> 8), (uint8_t)block, (uint8_t)type, 0x20 }, block + 2u });
+  }
+  runScript();
+  readTime = (sim::now_ns - t0) / 1e9;
+  for (auto &r : sim::scriptReplies) {
+    if (r.size() != block + 2u) continue;
+    CHECK(r[0] == 0x14 && r.back() == 0x10);
+    if (getenv("HDEBUG")) { for (size_t i = 0; i < r.size(); i++) printf("%02x%c", r[i], i % 32 == 31 ? '\n' : ' '); printf("\n"); }
+    out.insert(out.end(), r.begin() + 1, r.end() - 1);
+  }
+  sim::scriptReplies.clear();
+  return out;
+}
+
+static double writeEeprom(const std::vector<uint8_t> &img, uint16_t block) {
+  uint64_t t0 = sim::now_ns;
+  for (uint32_t a = 0; a < img.size(); a += block) {
+    loadAddr(a / 2);
+    std::vector<uint8_t> f = { 0x64, (uint8_t)(block >> 8), (uint8_t)block, 'E' };
+    f.insert(f.end(), img.begin() + a, img.begin() + a + block);
+    f.push_back(0x20);
+    CHECK(ok(cmd(f, 2)));
+  }
+  return (sim::now_ns - t0) / 1e9;
+}
+
+static void session(const TargetConfig &c) {
+  sim::reset();
+  target.configure(c);
+  setup();
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  if (getenv("PIPE")) CHECK(ok(cmd({ 0x40, 0xA2, (uint8_t)atoi(getenv("PIPE")), 0x20 }, 2)));
+  setDevice(c);
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  std::vector<uint8_t> r = cmd({ 0x75, 0x20 }, 5);
+  CHECK(r.size() == 5 && r[1] == c.sig[0] && r[2] == c.sig[1] && r[3] == c.sig[2]);
+}
+
+static std::vector<uint8_t> pattern(size_t n, int seed) {
+  std::vector<uint8_t> v(n);
+  for (size_t i = 0; i < n; i++) v[i] = (uint8_t)(i * 31 + seed + (i >> 8));
+  return v;
+}
+
+static void testPart(const char *name, const TargetConfig &c, uint32_t flashBytes, uint32_t eeBytes) {
+  session(c);
+  std::vector<uint8_t> img = pattern(flashBytes, 1);
+  double tf = writeFlash(img, c.flashPage);
+  std::vector<uint8_t> back = readMem('F', flashBytes, 256);
+  double tr = readTime;
+  CHECK(back == img);
+  if (back != img) for (size_t i = 0; i < back.size(); i++) if (back[i] != img[i]) { printf("  first mismatch at %zx\n", i); break; }
+  CHECK(std::equal(img.begin(), img.end(), target.flash.begin()));
+  std::vector<uint8_t> ee = pattern(eeBytes, 7);
+  double te = writeEeprom(ee, getenv("EEBLK") ? atoi(getenv("EEBLK")) : (c.eepromPage ? c.eepromPage : 4));
+  std::vector<uint8_t> eb = readMem('E', eeBytes, 256);
+  CHECK(eb == ee);
+  if (eb != ee) for (size_t i = 0; i < eb.size(); i++) if (eb[i] != ee[i]) { printf("  ee mismatch at %zx: %02x %02x (size %zu)\n", i, eb[i], ee[i], eb.size()); break; }
+  CHECK(std::equal(ee.begin(), ee.end(), target.eeprom.begin()));
+  CHECK(target.violations == 0);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  printf("%-12s flash %6u B in %7.3f s, read %7.3f s, eeprom %5u B in %7.3f s, violations %u, overruns %u\n",
+         name, flashBytes, tf, tr, eeBytes, te, target.violations, sim::rxOverruns);
+}
+
+static void testBigFlash() {
+  session(ATMEGA2560);
+  uint32_t base = 128 * 1024 - 2048;
+  std::vector<uint8_t> img = pattern(4096, 3);
+  writeFlash(img, 256, base);
+  CHECK(std::equal(img.begin(), img.end(), target.flash.begin() + base));
+  CHECK(readMem('F', 4096, 256, base) == img);
+  CHECK(target.violations == 0);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  printf("ATmega2560 across 128K boundary ok\n");
+}
+
+// arguments full of 0x20 and back-to-back frames must frame exactly
+static void testFraming() {
+  session(ATMEGA328P);
+  uint64_t t0 = sim::now_ns;
+  std::vector<uint8_t> r = cmd({ 0x56, 0x30, 0x00, 0x20, 0x00, 0x20, 0x55, 0x20, 0x20, 0x20, 0x30, 0x20 }, 7);
+  CHECK(r.size() == 7 && r[0] == 0x14 && r[2] == 0x10 && r[3] == 0x14 && r[4] == 0x10 && r[6] == 0x10);
+  r = cmd({ 0x20, 0x30, 0x20 }, 3);     // stray EOP, then back in sync
+  CHECK(r.size() == 3 && r[0] == 0x15 && r[1] == 0x14 && r[2] == 0x10);
+  r = cmd({ 0x99, 0x20 }, 1);           // unknown command
+  CHECK(r.size() == 1 && r[0] == 0x12);
+  r = cmd({ 0x62, 0xA0, 0x20, 0x20 }, 1);  // PROG_FUSE isn't implemented, but it's framed
+  CHECK(r.size() == 1 && r[0] == 0x12);
+  r = cmd({ 0x57, 1, 0x30, 0x20, 0x20 }, 1);  // and UNIVERSAL_MULTI by its count
+  CHECK(r.size() == 1 && r[0] == 0x12);
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  printf("framing ok, %.1f ms\n", (sim::now_ns - t0) / 1e6);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+}
+
+static uint8_t getParm(uint8_t p);
+
+// switch to 250000 baud for a session, then back at STK_PMODE_END
+static void testBaud() {
+  session(ATMEGA328P);
+  CHECK(ok(cmd({ 0x40, 0xA3, 9, 0x20 }, 2)) == false);   // no such rate
+  CHECK(ok(cmd({ 0x40, 0xA3, 5, 0x20 }, 2)));
+  runScript();                                            // let it switch
+  CHECK(sim::baud == 250000);
+  CHECK(getParm(0xA3) == 5);
+  std::vector<uint8_t> img = pattern(4096, 5);
+  double tw = writeFlash(img, 128);
+  std::vector<uint8_t> back = readMem('F', 4096, 256);
+  CHECK(back == img);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  runScript();
+  CHECK(sim::baud == 19200);
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  // a host that switches and goes away without STK_PMODE_END: a run of replies that make no
+  // sense, or BAUD_IDLE of silence, and it's back at ISP_BAUD
+  CHECK(ok(cmd({ 0x40, 0xA3, 4, 0x20 }, 2)));
+  runScript();
+  CHECK(sim::baud == 115200);
+  CHECK(cmd({ 0x20, 0x20, 0x20 }, 3) == (std::vector<uint8_t>{ 0x15, 0x15, 0x15 }));
+  CHECK(sim::baud == 115200);
+  CHECK(cmd({ 0x20 }, 1) == (std::vector<uint8_t>{ 0x15 }));
+  runScript();
+  CHECK(sim::baud == 19200);
+  CHECK(ok(cmd({ 0x40, 0xA3, 4, 0x20 }, 2)));
+  runScript();
+  CHECK(cmd({ 0x20, 0x30, 0x20 }, 3) == (std::vector<uint8_t>{ 0x15, 0x14, 0x10 }));  // in step again
+  sim::deadline_ns = sim::now_ns + 4900000000ULL;
+  try {
+    for (;;) loop();
+  } catch (sim::Timeout &) { }
+  CHECK(sim::baud == 115200);
+  sim::deadline_ns = sim::now_ns + 200000000ULL;
+  try {
+    for (;;) loop();
+  } catch (sim::Timeout &) { }
+  sim::deadline_ns = ~0ULL;
+  CHECK(sim::baud == 19200);
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  printf("250000 baud: flash 4096 B in %.3f s, read %.3f s, overruns %u\n", tw, readTime, sim::rxOverruns);
+}
+
+static uint8_t getParm(uint8_t p) {
+  std::vector<uint8_t> r = cmd({ 0x41, p, 0x20 }, 3);
+  CHECK(r.size() == 3 && r[0] == 0x14 && r[2] == 0x10);
+  return r.size() > 1 ? r[1] : 0;
+}
+
+static void testSpiRate() {
+  // one step below the fastest that passes: 2MHz is at the 328P's fck/6 limit, 250kHz at the tiny85's
+  session(ATMEGA328P);
+  CHECK(getParm(0xA0) == 16);
+  printf("328P @16MHz: divider %u, sck duration %u\n", getParm(0xA0), getParm(0x89));
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  session(ATTINY85);
+  CHECK(getParm(0xA0) == 128);
+  printf("tiny85 @1MHz: divider %u, sck duration %u\n", getParm(0xA0), getParm(0x89));
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  // avrdude -B 5 caps it
+  sim::reset(); target.configure(ATMEGA328P); setup();
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  CHECK(ok(cmd({ 0x40, 0x89, 5, 0x20 }, 2)));
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  CHECK(getParm(0xA0) == 128);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  // a cap short of the limit is taken as it is
+  CHECK(ok(cmd({ 0x40, 0x89, 1, 0x20 }, 2)));
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  CHECK(getParm(0xA0) == 16);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  CHECK(ok(cmd({ 0x40, 0x89, 0, 0x20 }, 2)));
+  // bare chip on CLOCK_OUT, 1MHz then 8MHz
+  sim::reset(); target.configure(BARE_M328); setup();
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  CHECK(getParm(0xA1) == 1);
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  CHECK(getParm(0xA0) == 128);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  CHECK(ok(cmd({ 0x40, 0xA1, 8, 0x20 }, 2)));
+  CHECK(getParm(0xA1) == 8);
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  CHECK(getParm(0xA0) == 16);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  CHECK(ok(cmd({ 0x40, 0xA1, 3, 0x20 }, 2)));
+  CHECK(getParm(0xA1) == 4);
+  CHECK(ok(cmd({ 0x40, 0xA1, 1, 0x20 }, 2)));
+}
+
+// RFC 1321's MD5 test suite, and the usual CRC-32 check value
+static const struct { const char *s; const char *md5; } md5Suite[] = {
+  { "", "d41d8cd98f00b204e9800998ecf8427e" },
+  { "a", "0cc175b9c0f1b6a831c399e269772661" },
+  { "abc", "900150983cd24fb0d6963f7d28e17f72" },
+  { "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+  { "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+  { "12345678901234567890123456789012345678901234567890123456789012345678901234567890", "57edf4a22be3c955ac49da2e2107b67a" },
+};
+static const char *crcCheck = "123456789";  // CRC-32 0xCBF43926
+
+static std::string hex(const uint8_t *p, size_t n) {
+  std::string h;
+  char b[3];
+  for (size_t i = 0; i < n; i++) { snprintf(b, sizeof b, "%02x", p[i]); h += b; }
+  return h;
+}
+
+static std::vector<uint8_t> checksum(char mem, uint8_t md5, uint32_t a, uint32_t n) {
+  std::vector<uint8_t> f = { 0x80, (uint8_t)mem, md5, (uint8_t)(a >> 24), (uint8_t)(a >> 16), (uint8_t)(a >> 8), (uint8_t)a,
+                             (uint8_t)(n >> 24), (uint8_t)(n >> 16), (uint8_t)(n >> 8), (uint8_t)n, 0x20 };
+  return cmd(f, md5 ? 19 : 7, 30000);
+}
+
+static void testChecksum() {
+  session(ATMEGA328P);
+  // 1K of i * 7 + 3 at 0x200, and the test strings back to back from 0x1000
+  std::vector<uint8_t> img(1024);
+  for (size_t i = 0; i < img.size(); i++) img[i] = i * 7 + 3;
+  std::vector<uint8_t> suite(256, 0xFF);
+  std::vector<std::pair<uint32_t, size_t> > at;
+  size_t o = 0;
+  for (auto &v : md5Suite) {
+    at.push_back({ 0x1000 + o, strlen(v.s) });
+    memcpy(&suite[o], v.s, strlen(v.s));
+    o += strlen(v.s);
+  }
+  memcpy(&suite[o], crcCheck, strlen(crcCheck));
+  writeFlash(img, target.cfg.flashPage, 0x200);
+  writeFlash(suite, target.cfg.flashPage, 0x1000);
+  std::vector<uint8_t> r = checksum('F', 0, 0x200, img.size());
+  CHECK(r.size() == 7 && r[1] == 0 && (uint32_t)(r[2] << 24 | r[3] << 16 | r[4] << 8 | r[5]) == 0x5D3DE8ED && r[6] == 0x10);
+  r = checksum('F', 0, 0x1000 + o, strlen(crcCheck));
+  CHECK(r.size() == 7 && (uint32_t)(r[2] << 24 | r[3] << 16 | r[4] << 8 | r[5]) == 0xCBF43926);
+  uint64_t t0 = sim::now_ns;
+  r = checksum('F', 1, 0x200, img.size());
+  CHECK(r.size() == 19 && r[1] == 0 && hex(&r[2], 16) == "a66351d9c8f941b70a02eaf9c41e69c3");
+  printf("checksum: md5 of %zu B in %.3f s\n", img.size(), (sim::now_ns - t0) / 1e9);
+  for (size_t i = 0; i < at.size(); i++) {
+    r = checksum('F', 1, at[i].first, at[i].second);
+    CHECK(r.size() == 19 && hex(&r[2], 16) == md5Suite[i].md5);
+  }
+  t0 = sim::now_ns;
+  r = checksum('F', 0, 0x4000, 0x4000); CHECK(r.size() == 7 && r[1] == 1);
+  printf("checksum: blank check of 16K in %.3f s\n", (sim::now_ns - t0) / 1e9);
+  r = checksum('E', 0, 0, 1024); CHECK(r.size() == 7 && r[1] == 1);
+  r = cmd({ 0x80, 'X', 0, 0, 0, 0, 0, 0, 0, 0, 16, 0x20 }, 2); CHECK(r.size() == 2 && r[1] == 0x11);
+  // stream it back with a couple of pages changed, then a short page off the end
+  std::vector<uint8_t> want(img);
+  want[130] ^= 1; want[1023] ^= 0x80;
+  uint16_t page = target.cfg.flashPage;
+  loadAddr(0x100);
+  t0 = sim::now_ns;
+  for (uint32_t a = 0; a < want.size(); a += page) {
+    std::vector<uint8_t> f = { 0x81, (uint8_t)(page >> 8), (uint8_t)page, 'F' };
+    f.insert(f.end(), want.begin() + a, want.begin() + a + page);
+    f.push_back(0x20);
+    CHECK(ok(cmd(f, 2)));
+  }
+  printf("verify: %zu B in %.3f s\n", want.size(), (sim::now_ns - t0) / 1e9);
+  CHECK(ok(cmd({ 0x81, 0, 2, 'F', 0xFF, 0xFF, 0x20 }, 2)));
+  r = cmd({ 0x82, 0x20 }, 6);
+  CHECK(r.size() == 6 && r[1] == 0 && r[2] == 9 && r[3] == 0x82 && r[4] == 0 && r[5] == 0x10);
+  r = cmd({ 0x82, 0x20 }, 4);
+  CHECK(r.size() == 4 && r[2] == 0);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+}
+
+static void pageCounts(uint16_t &w, uint16_t &k) {
+  std::vector<uint8_t> r = cmd({ 0x83, 0x20 }, 6);
+  CHECK(r.size() == 6 && r[0] == 0x14 && r[5] == 0x10);
+  w = r.size() == 6 ? r[1] * 256 + r[2] : 0; k = r.size() == 6 ? r[3] * 256 + r[4] : 0;
+}
+
+static void testDelta() {
+  session(ATMEGA328P);
+  CHECK(ok(cmd({ 0x40, 0xA4, 1, 0x20 }, 2)));
+  CHECK(getParm(0xA4) == 1);
+  CHECK(ok(cmd({ 0x56, 0xAC, 0x80, 0, 0, 0x20 }, 3)));
+  std::vector<uint8_t> img(4096, 0xFF);
+  for (size_t i = 0; i < 3000; i++) img[i] = rand();
+  double t1 = writeFlash(img, 128);
+  CHECK(std::equal(img.begin(), img.end(), target.flash.begin()));
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  uint16_t w, k;
+  pageCounts(w, k);
+  CHECK(w == 24 && k == 8);
+  // same build again, no erase, then one page changed
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  double t2 = writeFlash(img, 128);
+  pageCounts(w, k);
+  CHECK(w == 0 && k == 32);
+  img[1000] &= 0x0F;
+  writeFlash(img, 128);
+  pageCounts(w, k);
+  CHECK(w == 1 && k == 63);
+  CHECK(std::equal(img.begin(), img.end(), target.flash.begin()));
+  // setting bits back needs an erase, so that page fails and the flash is left alone
+  img[1000] |= 0xF0;
+  CHECK(ok(cmd({ 0x55, 448 & 0xFF, 448 >> 8, 0x20 }, 2)));
+  std::vector<uint8_t> f = { 0x64, 0, 128, 'F' };
+  f.insert(f.end(), img.begin() + 896, img.begin() + 1024);
+  f.push_back(0x20);
+  CHECK(ok(cmd(f, 2)));                                    // pipelined, reported on the next reply
+  CHECK(cmd({ 0x51, 0x20 }, 2) == (std::vector<uint8_t>{ 0x14, 0x11 }));
+  CHECK(target.flash[1000] == (img[1000] & 0x0F));
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  // or on whatever comes after it, here the verify's STK_SET_ADDR, and then it's back in step
+  CHECK(ok(cmd({ 0x55, 448 & 0xFF, 448 >> 8, 0x20 }, 2)));
+  CHECK(ok(cmd(f, 2)));
+  CHECK(cmd({ 0x55, 0, 0, 0x20 }, 2) == (std::vector<uint8_t>{ 0x14, 0x11 }));
+  CHECK(ok(cmd({ 0x55, 0, 0, 0x20 }, 2)));
+  std::vector<uint8_t> r = cmd({ 0x74, 0, 2, 'F', 0x20 }, 4);
+  CHECK(r.size() == 4 && r[1] == img[0] && r[2] == img[1]);
+  printf("delta: erased 4K %.3f s, unchanged 4K %.3f s\n", t1, t2);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  CHECK(ok(cmd({ 0x40, 0xA4, 0, 0x20 }, 2)));
+}
+
+static std::vector<uint8_t> packBits(const uint8_t *p, size_t n) {
+  std::vector<uint8_t> out;
+  size_t i = 0;
+  while (i < n) {
+    size_t run = 1;
+    while (i + run < n && run < 128 && p[i + run] == p[i]) run++;
+    if (run >= 3) { out.push_back((uint8_t)(1 - (int)run)); out.push_back(p[i]); i += run; continue; }
+    size_t lit = 0;
+    while (i + lit < n && lit < 128 && !(i + lit + 2 < n && p[i + lit] == p[i + lit + 1] && p[i + lit] == p[i + lit + 2])) lit++;
+    out.push_back(lit - 1);
+    out.insert(out.end(), p + i, p + i + lit);
+    i += lit;
+  }
+  return out;
+}
+
+static void testPacked() {
+  for (int pipe = 0; pipe < 2; pipe++) {
+    session(ATMEGA328P);
+    CHECK(ok(cmd({ 0x40, 0xA2, (uint8_t)pipe, 0x20 }, 2)));
+    CHECK(ok(cmd({ 0x56, 0xAC, 0x80, 0, 0, 0x20 }, 3)));
+    // code-ish data, a constant table and padding
+    std::vector<uint8_t> img(4096, 0xFF);
+    for (size_t i = 0; i < 1500; i++) img[i] = rand() & 0x3F;
+    for (size_t i = 1500; i < 2500; i++) img[i] = (i / 16) & 1 ? 0 : 0x55;
+    size_t raw = 0, packed = 0;
+    uint64_t t0 = sim::now_ns;
+    for (uint32_t a = 0; a < img.size(); a += 128) {
+      uint32_t word = a / 2;
+      sim::script.push_back({ { 0x55, (uint8_t)word, (uint8_t)(word >> 8), 0x20 }, 2 });
+      std::vector<uint8_t> pk = packBits(&img[a], 128);
+      std::vector<uint8_t> f = { 0x84, (uint8_t)(pk.size() >> 8), (uint8_t)pk.size(), 'F' };
+      f.insert(f.end(), pk.begin(), pk.end());
+      f.push_back(0x20);
+      sim::script.push_back({ f, 2 });
+      raw += 128; packed += pk.size();
+    }
+    runScript();
+    for (auto &r : sim::scriptReplies) CHECK(r.back() == 0x10);
+    sim::scriptReplies.clear();
+    double t = (sim::now_ns - t0) / 1e9;
+    CHECK(std::equal(img.begin(), img.end(), target.flash.begin()));
+    if (pipe) printf("packed: %zu B as %zu B in %.3f s\n", raw, packed, t);
+    // a bad one doesn't write
+    CHECK(cmd({ 0x84, 0, 2, 'F', 5, 1, 0x20 }, 3).back() == 0x15);
+    CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+    CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  }
+}
+
+static void testBatch() {
+  session(ATMEGA328P);
+  uint32_t desyncs = target.desyncs;
+  uint64_t t0 = sim::now_ns;
+  // write the high fuse, then read sig, fuses, lock and calibration back in the same batch
+  std::vector<uint8_t> f = { 0x85, 9,  0xAC, 0xA8, 0, 0xDE,  0x30, 0, 0, 0,  0x30, 0, 1, 0,  0x30, 0, 2, 0,
+                             0x50, 0, 0, 0,  0x58, 8, 0, 0,  0x50, 8, 0, 0,  0x58, 0, 0, 0,  0x38, 0, 0, 0,  0x20 };
+  std::vector<uint8_t> r = cmd(f, 11);
+  printf("batch: 9 instructions in %.3f ms\n", (sim::now_ns - t0) / 1e6);
+  CHECK(r.size() == 11 && r[0] == 0x14 && r[10] == 0x10);
+  if (r.size() == 11) {
+    CHECK(r[2] == target.cfg.sig[0] && r[3] == target.cfg.sig[1] && r[4] == target.cfg.sig[2]);
+    CHECK(r[5] == 0x62 && r[6] == 0xDE && r[7] == 0xFF && r[8] == 0xFF && r[9] == 0x9A);
+  }
+  CHECK(target.desyncs == desyncs);
+  // EEPROM and flash page writes are waited out too, so they read straight back
+  uint32_t busy = target.violations;
+  f = { 0x85, 6,  0xC0, 0, 0x10, 0x5A,  0xA0, 0, 0x10, 0,  0x40, 0, 0, 0x12,  0x48, 0, 0, 0x34,
+        0x4C, 0, 0, 0,  0x28, 0, 0, 0,  0x20 };
+  r = cmd(f, 8);
+  CHECK(r.size() == 8 && r[2] == 0x5A && r[6] == 0x34 && r[7] == 0x10);
+  CHECK(target.violations == busy && target.eeprom[0x10] == 0x5A && target.flash[0] == 0x12);
+  CHECK(cmd({ 0x85, 40 }, 1) == std::vector<uint8_t>{ 0x15 });
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+}
+
+static void testSerial() {
+  session(ATMEGA328P);
+  // 32 bit little endian at 0x10
+  CHECK(ok(cmd({ 0x8A, 0x00, 0x10, 4, 0, 0x00, 0x01, 0x02, 0x03, 0x20 }, 2)));
+  std::vector<uint8_t> ee = pattern(64, 5);
+  writeEeprom(ee, 32);
+  CHECK(target.eeprom[0x0F] == ee[0x0F] && target.eeprom[0x14] == ee[0x14]);
+  CHECK(target.eeprom[0x10] == 0x03 && target.eeprom[0x11] == 0x02 && target.eeprom[0x12] == 0x01 && target.eeprom[0x13] == 0x00);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  // the next board, after a power cycle, gets the next number
+  session(ATMEGA328P);
+  writeEeprom(ee, 4);
+  CHECK(target.eeprom[0x10] == 0x04 && target.eeprom[0x13] == 0x00);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  // a session that doesn't touch it doesn't use one up
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  std::vector<uint8_t> r = cmd({ 0x8B, 0x20 }, 10);
+  CHECK(r == (std::vector<uint8_t>{ 0x14, 0x00, 0x10, 4, 0, 0x00, 0x01, 0x02, 0x05, 0x10 }));
+  // 6 ASCII digits, straddling a page
+  CHECK(ok(cmd({ 0x8A, 0x00, 0x1E, 6, 2, 0x00, 0x01, 0xE2, 0x3F, 0x20 }, 2)));  // 123455
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  writeEeprom(ee, 32);
+  CHECK(memcmp(&target.eeprom[0x1E], "123455", 6) == 0 && target.eeprom[0x24] == ee[0x24]);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  r = cmd({ 0x8B, 0x20 }, 10);
+  CHECK(r.size() == 10 && r[8] == 0x40);
+  // bad templates are refused, and width 0 turns it off
+  CHECK(cmd({ 0x8A, 0x00, 0x10, 5, 0, 0, 0, 0, 0, 0x20 }, 2) == (std::vector<uint8_t>{ 0x14, 0x11 }));
+  CHECK(cmd({ 0x8A, 0x00, 0x10, 4, 3, 0, 0, 0, 0, 0x20 }, 2) == (std::vector<uint8_t>{ 0x14, 0x11 }));
+  CHECK(ok(cmd({ 0x8A, 0x00, 0x00, 0, 0, 0, 0, 0, 0, 0x20 }, 2)));
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  writeEeprom(ee, 32);
+  CHECK(std::equal(ee.begin(), ee.end(), target.eeprom.begin()));
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  printf("serial ok\n");
+}
+
+// STK_PERF_GET: six 32 bit values, four 16 bit ones, then (command, 16 bit count) pairs
+static std::vector<uint8_t> perfGet() { return cmd({ 0x8C, 0x20 }, 92); }
+static uint32_t perf32(const std::vector<uint8_t> &r, int i) { return (r[1 + 4 * i] << 24) | (r[2 + 4 * i] << 16) | (r[3 + 4 * i] << 8) | r[4 + 4 * i]; }
+static uint16_t perf16(const std::vector<uint8_t> &r, int i) { return (r[25 + 2 * i] << 8) | r[26 + 2 * i]; }
+static uint16_t perfCount(const std::vector<uint8_t> &r, uint8_t c) {
+  for (int i = 0; i < r[33]; i++) if (r[34 + 3 * i] == c) return (r[35 + 3 * i] << 8) | r[36 + 3 * i];
+  return 0xFFFF;
+}
+
+static void testPerf() {
+  session(ATMEGA328P);
+  // one frame at a time, writeFlash() and readMem() finish on a STK_GET_SYNC
+  std::vector<uint8_t> img = pattern(1024, 9);
+  for (uint32_t a = 0; a < img.size(); a += 128) {
+    loadAddr(a / 2);
+    std::vector<uint8_t> f = { 0x64, 0x00, 0x80, 'F' };
+    f.insert(f.end(), img.begin() + a, img.begin() + a + 128);
+    f.push_back(0x20);
+    CHECK(ok(cmd(f, 2)));
+  }
+  for (uint32_t a = 0; a < img.size(); a += 128) {
+    loadAddr(a / 2);
+    std::vector<uint8_t> r = cmd({ 0x74, 0x00, 0x80, 'F', 0x20 }, 130);
+    CHECK(ok(r) && std::equal(r.begin() + 1, r.end() - 1, img.begin() + a));
+  }
+  CHECK(cmd({ 0x99, 0x20 }, 1) == (std::vector<uint8_t>{ 0x12 }));
+  CHECK(cmd({ 0x41, 0x80, 0x21 }, 1) == (std::vector<uint8_t>{ 0x15 }));
+  std::vector<uint8_t> r = perfGet();
+  CHECK(ok(r) && r.size() == 92 && r[33] == 19);
+  if (r.size() != 92) return;
+  uint32_t wait = perf32(r, 0), tx = perf32(r, 1), handling = perf32(r, 2), busy = perf32(r, 3);
+  uint32_t spiBytes = perf32(r, 4), spiUs = perf32(r, 5);
+  CHECK(wait > 0 && tx > 0 && handling > 0 && busy > 0);
+  CHECK(spiBytes >= 1024 * 8 && spiUs == spiBytes * 8);  // 8 bits at 1MHz (divider 16 for the 328P)
+  CHECK(perf16(r, 0) == 1 && perf16(r, 1) == 1 && perf16(r, 2) == 0);
+  CHECK(perf16(r, 3) >= 128 + 5 && perf16(r, 3) < 2 * (256 + 8));
+  CHECK(perfCount(r, 0x30) == 1 && perfCount(r, 0x50) == 1 && perfCount(r, 0x64) == 8 && perfCount(r, 0x74) == 8);
+  CHECK(perfCount(r, 0x00) == 1);  // 0x99
+  printf("perf: wait %.3f s, tx %.3f s, commands %.3f s, target %.3f s, SPI %u B in %.3f s\n",
+         wait / 1e6, tx / 1e6, handling / 1e6, busy / 1e6, spiBytes, spiUs / 1e6);
+  // STK_GET_SYNC starts them over
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  r = perfGet();
+  CHECK(ok(r) && r.size() == 92 && perf16(r, 1) == 0 && perfCount(r, 0x30) == 1 && perfCount(r, 0x64) == 0 && perfCount(r, 0x00) == 0);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  printf("perf ok\n");
+}
+
+extern uint8_t leds_on;
+static void testLeds() {
+  sim::reset(); target.configure(ATMEGA328P);
+  leds_on = 0;                                    // a real reset would clear it along with the pins
+  setup();
+  delay(200);                                     // past the power up blinks
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  setDevice(ATMEGA328P);
+  uint32_t ticks = sim::timerTicks;
+  uint64_t t0 = sim::now_ns;
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  double pmode = (sim::now_ns - t0) / 1e6;
+
+  t0 = sim::now_ns;
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  printf("leds: STK_PMODE_START answered in %.2f ms, STK_GET_SYNC in %.2f ms\n", pmode, (sim::now_ns - t0) / 1e6);
+  CHECK(!(PORTB & 1));                            // LED_ERR off
+  CHECK(cmd({ 0x99, 0x20 }, 1) == (std::vector<uint8_t>{ 0x12 }));
+  delay(1);
+  CHECK(PORTB & 1);                               // and on after an error
+  CHECK(sim::timerTicks > ticks);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  delay(100);
+  CHECK(!(PORTC & 1));                            // the piezo is quiet afterwards
+}
+
+static uint8_t v2seq = 0;
+// wrap a body in an STK500v2 message and return the reply body, checking the framing
+static std::vector<uint8_t> v2(std::vector<uint8_t> body, size_t rxbody, bool corrupt = false) {
+  std::vector<uint8_t> f = { 0x1B, ++v2seq, (uint8_t)(body.size() >> 8), (uint8_t)body.size(), 0x0E };
+  f.insert(f.end(), body.begin(), body.end());
+  uint8_t sum = 0; for (auto b : f) sum ^= b;
+  f.push_back(corrupt ? sum ^ 1 : sum);
+  std::vector<uint8_t> r = cmd(f, rxbody + 6);
+  CHECK(r.size() == rxbody + 6);
+  if (r.size() != rxbody + 6) return {};
+  uint8_t rs = 0; for (auto b : r) rs ^= b;
+  CHECK(rs == 0 && r[0] == 0x1B && r[1] == v2seq && r[4] == 0x0E && (size_t)(r[2] * 256 + r[3]) == rxbody);
+  return std::vector<uint8_t>(r.begin() + 5, r.end() - 1);
+}
+
+static void testV2() {
+  sim::reset(); target.configure(ATMEGA328P); setup();
+  std::vector<uint8_t> r = v2({ 0x01 }, 11);
+  CHECK(r.size() == 11 && r[1] == 0 && std::string(r.begin() + 3, r.end()) == "AVRISP_2");
+  r = v2({ 0x03, 0x91 }, 3); CHECK(r.size() == 3 && r[2] == 1);
+  CHECK(v2({ 0x02, 0x98, 1 }, 2)[1] == 0);                  // cap SCK at 460.8kHz
+  r = v2({ 0x10, 200, 100, 25, 32, 0, 0x53, 3, 0xAC, 0x53, 0, 0 }, 2); CHECK(r[1] == 0);
+  CHECK(v2({ 0x03, 0x98 }, 3)[2] == 2);                    // 250kHz
+  r = v2({ 0x1B, 4, 0x30, 0, 1, 0 }, 4); CHECK(r.size() == 4 && r[2] == target.cfg.sig[1]);
+  r = v2({ 0x12, 10, 0, 0xAC, 0x80, 0, 0 }, 2); CHECK(r[1] == 0);
+  // two pages with RDY/BSY polling (mode 0xC1), then read them back in one go
+  std::vector<uint8_t> img(256);
+  for (size_t i = 0; i < img.size(); i++) img[i] = rand();
+  CHECK(v2({ 0x06, 0, 0, 0, 0 }, 2)[1] == 0);
+  for (int p = 0; p < 2; p++) {
+    std::vector<uint8_t> b = { 0x13, 0, 128, 0xC1, 10, 0x40, 0x4C, 0x20, 0xFF, 0xFF };
+    b.insert(b.end(), img.begin() + p * 128, img.begin() + p * 128 + 128);
+    CHECK(v2(b, 2)[1] == 0);
+  }
+  CHECK(v2({ 0x06, 0, 0, 0, 0 }, 2)[1] == 0);
+  r = v2({ 0x14, 1, 0, 0x20 }, 259);
+  CHECK(r.size() == 259 && std::vector<uint8_t>(r.begin() + 2, r.end() - 1) == img);
+  // a third page in two halves: the first only loaded (mode 0x41), the second writes it (0xC1)
+  uint32_t writes = target.pageWrites;
+  CHECK(v2({ 0x06, 0, 0, 0, 128 }, 2)[1] == 0);
+  for (int h = 0; h < 2; h++) {
+    std::vector<uint8_t> b = { 0x13, 0, 64, (uint8_t)(h ? 0xC1 : 0x41), 10, 0x40, 0x4C, 0x20, 0xFF, 0xFF };
+    b.insert(b.end(), img.begin() + h * 64, img.begin() + h * 64 + 64);
+    CHECK(v2(b, 2)[1] == 0);
+    CHECK(target.pageWrites == writes + h);
+  }
+  CHECK(std::equal(img.begin(), img.begin() + 128, target.flash.begin() + 256));
+  // EEPROM, 4 byte pages
+  CHECK(v2({ 0x06, 0, 0, 0, 8 }, 2)[1] == 0);
+  CHECK(v2({ 0x15, 0, 6, 0xC1, 10, 0xC1, 0xC2, 0xA0, 0xFF, 0xFF, 1, 2, 3, 4, 5, 6 }, 2)[1] == 0);
+  CHECK(v2({ 0x06, 0, 0, 0, 8 }, 2)[1] == 0);
+  r = v2({ 0x16, 0, 6, 0xA0 }, 9);
+  CHECK(r.size() == 9 && r[2] == 1 && r[7] == 6);
+  // a fuse write is waited out before the reply, so reading it straight back is fine, and one
+  // that never finishes is a timeout
+  uint32_t busy = target.violations, twd = target.cfg.twdFuseUs;
+  target.cfg.twdFuseUs = 20000;
+  r = v2({ 0x17, 0xAC, 0xA8, 0, 0xDE }, 3); CHECK(r.size() == 3 && r[1] == 0 && r[2] == 0);
+  r = v2({ 0x18, 4, 0x58, 0x08, 0, 0 }, 4); CHECK(r.size() == 4 && r[2] == 0xDE);
+  CHECK(target.violations == busy);
+  target.cfg.twdFuseUs = 200000;
+  CHECK(v2({ 0x19, 0xAC, 0xE0, 0, 0xFC }, 2)[1] == 0x80);
+  target.cfg.twdFuseUs = twd;
+  sim::advance(200000000);
+  // SPI_MULTI: the signature byte comes back 4th
+  r = v2({ 0x1D, 4, 1, 3, 0x30, 0, 2, 0 }, 4); CHECK(r.size() == 4 && r[2] == target.cfg.sig[2]);
+  r = v2({ 0x11, 1, 1 }, 2, true); CHECK(r.size() == 2 && r[0] == 0xB0 && r[1] == 0xC1);
+  CHECK(v2({ 0x11, 1, 1 }, 2)[1] == 0);
+  CHECK(v2({ 0x02, 0x98, 0 }, 2)[1] == 0);
+  printf("stk500v2 ok\n");
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));                       // v1 still there
+}
+
+#ifdef SIM_GANG
+extern Target gangTargets[3];
+static void testGang() {
+  // target on SS, 2 and 4 present, 5 missing (never answers)
+  sim::reset();
+  target.configure(ATMEGA328P); gangTargets[0].configure(ATMEGA328P); gangTargets[1].configure(ATMEGA328P);
+  TargetConfig dead = ATMEGA328P; dead.clockHz = 0; gangTargets[2].configure(dead);
+  setup();
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  setDevice(ATMEGA328P);
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  CHECK(getParm(0xA6) == 0x08);
+  CHECK(ok(cmd({ 0x56, 0xAC, 0x80, 0, 0, 0x20 }, 3)));
+  sim::advance(20000000);
+  std::vector<uint8_t> img(4096);
+  for (auto &b : img) b = rand();
+  double t = writeFlash(img, 128);
+  CHECK(std::equal(img.begin(), img.end(), target.flash.begin()));
+  CHECK(std::equal(img.begin(), img.end(), gangTargets[0].flash.begin()));
+  CHECK(std::equal(img.begin(), img.end(), gangTargets[1].flash.begin()));
+  CHECK(getParm(0xA6) == 0x08);
+  printf("gang: 3 targets, 4096 B in %.3f s\n", t);
+  // target 1 goes bad half way through
+  CHECK(ok(cmd({ 0x56, 0xAC, 0x80, 0, 0, 0x20 }, 3)));
+  sim::advance(20000000);
+  for (auto &b : img) b = rand();
+  writeFlash(std::vector<uint8_t>(img.begin(), img.begin() + 2048), 128);
+  gangTargets[0].cfg.clockHz = 1;  // too slow for anything now
+  writeFlash(std::vector<uint8_t>(img.begin() + 2048, img.end()), 128, 2048);
+  CHECK(std::equal(img.begin(), img.end(), target.flash.begin()));
+  CHECK(std::equal(img.begin(), img.end(), gangTargets[1].flash.begin()));
+  CHECK(getParm(0xA6) == 0x0A);
+  // the dropped ones are held in reset with their MISO buffer off until the session ends
+  CHECK(!sim::pinLevel(2) && !sim::pinLevel(5) && sim::pinLevel(A2) && sim::pinLevel(A4));
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  CHECK(sim::pinLevel(2) && sim::pinLevel(5));
+  // a different part on 4 is dropped at the signature check, and has to be out of programming
+  // mode too: it hears every erase, page and fuse write that goes to the rest
+  sim::reset();
+  target.configure(ATMEGA328P); gangTargets[0].configure(ATMEGA328P); gangTargets[2].configure(ATMEGA328P);
+  gangTargets[1].configure(ATMEGA8A);
+  for (auto &b : gangTargets[1].flash) b = rand();
+  for (auto &b : gangTargets[1].eeprom) b = rand();
+  Target odd = gangTargets[1];
+  setup();
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  setDevice(ATMEGA328P);
+  CHECK(ok(cmd({ 0x50, 0x20 }, 2)));
+  CHECK(getParm(0xA6) == 0x04);
+  CHECK(ok(cmd({ 0x56, 0xAC, 0x80, 0, 0, 0x20 }, 3)));
+  sim::advance(20000000);
+  for (auto &b : img) b = rand();
+  writeFlash(img, 128);
+  writeEeprom(std::vector<uint8_t>(img.begin(), img.begin() + 64), 4);
+  CHECK(ok(cmd({ 0x56, 0xAC, 0xA0, 0, 0xFF, 0x20 }, 3)));
+  sim::advance(10000000);
+  CHECK(ok(cmd({ 0x56, 0xAC, 0xA8, 0, 0xDE, 0x20 }, 3)));
+  sim::advance(10000000);
+  CHECK(ok(cmd({ 0x51, 0x20 }, 2)));
+  CHECK(std::equal(img.begin(), img.end(), gangTargets[2].flash.begin()));
+  CHECK(target.fuses[0] == 0xFF && target.fuses[1] == 0xDE);
+  CHECK(gangTargets[1].flash == odd.flash && gangTargets[1].eeprom == odd.eeprom);
+  CHECK(!memcmp(gangTargets[1].fuses, odd.fuses, 3) && gangTargets[1].lock == odd.lock);
+  printf("gang ok\n");
+}
+#endif
+
+#ifdef SIM_STAMP
+static void stampWrite(uint32_t a, const std::vector<uint8_t> &d) {
+  for (size_t o = 0; o < d.size(); o += 200) {
+    size_t n = std::min<size_t>(200, d.size() - o);
+    uint32_t x = a + o;
+    std::vector<uint8_t> f = { 0x87, (uint8_t)(x >> 16), (uint8_t)(x >> 8), (uint8_t)x, (uint8_t)(n >> 8), (uint8_t)n };
+    f.insert(f.end(), d.begin() + o, d.begin() + o + n);
+    f.push_back(0x20);
+    CHECK(ok(cmd(f, 2, 20000)));
+  }
+}
+
+static void testStamp() {
+  sim::reset(); target.configure(ATMEGA328P); setup();
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  CHECK(ok(cmd({ 0x86, 1, 0x20 }, 2, 20000)));
+  std::vector<uint8_t> img(3000), ee(100);
+  for (auto &b : img) b = rand();
+  for (size_t i = 1024; i < 2048; i++) img[i] = 0xFF;
+  for (auto &b : ee) b = rand();
+  const TargetConfig &c = ATMEGA328P;
+  std::vector<uint8_t> h = { 'A', 'S', 'M', 'S', c.sig[0], c.sig[1], c.sig[2], 0x02, 0, 0xDA, 0, 0,
+                             0, 0, (uint8_t)(img.size() >> 8), (uint8_t)img.size(), (uint8_t)(c.flashPage >> 8), (uint8_t)c.flashPage,
+                             0, (uint8_t)ee.size(), c.eepromPage, 1 };
+  stampWrite(0, h);
+  stampWrite(256, img);
+  stampWrite(256 + 3072, ee);
+  std::vector<uint8_t> r = cmd({ 0x88, 0, 1, 0, 0, 16, 0x20 }, 18);
+  CHECK(r.size() == 18 && std::equal(img.begin(), img.begin() + 16, r.begin() + 1));
+  // from the button
+  uint64_t t0 = sim::now_ns;
+  sim::buttonUntil = t0 + 2000000000ULL;  // held for 2 s, past the end, and bouncing on release
+  sim::buttonBounces = { { t0 + 2010000000ULL, t0 + 2012000000ULL }, { t0 + 2040000000ULL, t0 + 2041000000ULL } };
+  sim::deadline_ns = t0 + 10000000000ULL;  // loop() waits on serial once it's done
+  try {
+    for (;;) loop();
+  } catch (sim::Timeout &) { }
+  sim::deadline_ns = ~0ULL;
+  sim::buttonBounces.clear();
+  CHECK(std::equal(img.begin(), img.end(), target.flash.begin()));
+  CHECK(std::equal(ee.begin(), ee.end(), target.eeprom.begin()));
+  CHECK(target.fuses[1] == 0xDA);
+  CHECK(target.pageWrites == 16);                          // once, the bounces didn't count
+  // and from the host, onto a different part
+  target.configure(ATTINY85);
+  r = cmd({ 0x89, 0x20 }, 2, 20000);
+  CHECK(r.size() == 2 && r[1] == 0x11);
+  target.configure(ATMEGA328P);
+  t0 = sim::now_ns;
+  r = cmd({ 0x89, 0x20 }, 2, 20000);
+  printf("stamp: 3000 B flash + 100 B EEPROM in %.3f s\n", (sim::now_ns - t0) / 1e9);
+  CHECK(r.size() == 2 && r[1] == 0x10);
+  CHECK(std::equal(img.begin(), img.end(), target.flash.begin()));
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  // a storage chip that never comes ready fails the erase and the write, and we stay in sync
+  sim::storageStuck = true;
+  CHECK(cmd({ 0x86, 1, 0x20 }, 2, 20000) == (std::vector<uint8_t>{ 0x14, 0x11 }));
+  CHECK(cmd({ 0x87, 0, 0, 0, 0, 4, 1, 2, 3, 4, 0x20 }, 2) == (std::vector<uint8_t>{ 0x14, 0x11 }));
+  sim::storageStuck = false;
+  CHECK(ok(cmd({ 0x30, 0x20 }, 2)));
+  printf("stamp ok\n");
+}
+#endif
+
+int main() {
+#ifdef SIM_STAMP
+  testStamp();
+  printf(fails ? "%d FAILURES\n" : "all ok\n", fails);
+  return fails != 0;
+#endif
+#ifdef SIM_GANG
+  testGang();
+  printf(fails ? "%d FAILURES\n" : "all ok\n", fails);
+  return fails != 0;
+#endif
+  testFraming();
+  testBaud();
+  testSpiRate();
+  testBigFlash();
+  testPart("ATmega328P", ATMEGA328P, 4096, 1024);
+  testPart("ATmega8A", ATMEGA8A, 2048, 512);
+  testPart("ATtiny85", ATTINY85, 2048, 512);
+  testPart("ATmega2560", ATMEGA2560, 4096, 512);
+  testV2();
+  testChecksum();
+  testDelta();
+  testPacked();
+  testBatch();
+  testSerial();
+  testPerf();
+  testLeds();
+  printf(fails ? "%d FAILURES\n" : "all ok\n", fails);
+  return fails != 0;
+}
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+# Write the benchmark sessions for an ATmega328P, frame for frame as avrdude 6.3 sends them with
+# -c arduino (stk500.c): sync and sign-on, STK_SET_DEVICE and _EXT, programming mode, then the
+# session itself, one STK_UNIVERSAL per signature, fuse or erase instruction and a
+# STK_LOAD_ADDRESS before every page.  Replies the model's state decides are "??".
+#
+#   traces.py outdir
+#
+# Trace format, for bench.cpp and for asm_isp -r: "> " and the bytes the host sent, "< " and the
+# bytes it got back, in hex, one exchange per pair of lines; ". ms" where the host waits before
+# sending on, as avrdude does after an erase or a fuse write.  # starts a comment.
+import os, random, sys
+
+out = sys.argv[1]
+os.makedirs(out, exist_ok=True)
+random.seed(328)
+
+class Trace:
+    def __init__(self, name, what):
+        self.f = open(os.path.join(out, name + '.trace'), 'w')
+        self.f.write('# %s\n' % what)
+    def x(self, send, reply):
+        self.f.write('> %s\n< %s\n' % (' '.join('%02x' % b for b in send),
+                                       ' '.join(b if isinstance(b, str) else '%02x' % b for b in reply)))
+    def wait(self, ms):
+        self.f.write('. %g\n' % ms)
+    def open(self):
+        self.x([0x30, 0x20], [0x14, 0x10])                         # STK_GET_SYNC
+        self.x([0x41, 0x80, 0x20], [0x14, 0x02, 0x10])             # hardware version
+        self.x([0x41, 0x81, 0x20], [0x14, '??', 0x10])             # firmware major
+        self.x([0x41, 0x82, 0x20], [0x14, '??', 0x10])             # firmware minor
+        self.init()
+        for n in range(3):                                         # signature
+            self.x([0x56, 0x30, 0x00, n, 0x00, 0x20], [0x14, [0x1E, 0x95, 0x0F][n], 0x10])
+    def init(self):
+        self.x([0x42, 0x86, 0, 0, 1, 1, 1, 1, 3, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x80, 0x04, 0x00,
+                0x00, 0x00, 0x80, 0x00, 0x20], [0x14, 0x10])       # STK_SET_DEVICE
+        self.x([0x45, 0x05, 0x04, 0xD7, 0xC2, 0x00, 0x20], [0x14, 0x10])
+        self.x([0x50, 0x20], [0x14, 0x10])                         # STK_ENTER_PROGMODE
+    def erase(self):
+        self.x([0x56, 0xAC, 0x80, 0x00, 0x00, 0x20], [0x14, 0x00, 0x10])
+        self.wait(9)                                               # chip_erase_delay
+        self.init()                                                # avrdude starts over after it
+    def pages(self, cmd, mem, addr_div, data, page):
+        for a in range(0, len(data), page):
+            chunk = data[a:a + page]
+            w = a // addr_div
+            self.x([0x55, w & 0xFF, w >> 8, 0x20], [0x14, 0x10])
+            if cmd == 0x64:
+                self.x([0x64, len(chunk) >> 8, len(chunk) & 0xFF, mem] + chunk + [0x20], [0x14, 0x10])
+            else:
+                self.x([0x74, len(chunk) >> 8, len(chunk) & 0xFF, mem, 0x20], [0x14] + chunk + [0x10])
+    def close(self):
+        self.x([0x51, 0x20], [0x14, 0x10])                         # STK_LEAVE_PROGMODE
+        self.f.close()
+
+t = Trace('signature', 'avrdude -p m328p: sign on and read the signature')
+t.open()
+t.close()
+
+flash = [random.randrange(256) for _ in range(32 * 1024)]
+t = Trace('flash32k', 'avrdude -p m328p -U flash:w:32k.bin: erase, write and verify 32K of flash')
+t.open()
+t.erase()
+t.pages(0x64, 0x46, 2, flash, 128)
+t.pages(0x74, 0x46, 2, flash, 128)
+t.close()
+
+eeprom = [random.randrange(256) for _ in range(1024)]
+t = Trace('eeprom', 'avrdude -p m328p -U eeprom:w:1k.bin: write and verify 1K of EEPROM')
+t.open()
+t.pages(0x64, 0x45, 2, eeprom, 4)
+t.pages(0x74, 0x45, 2, eeprom, 4)
+t.close()
+
+t = Trace('fuses', 'avrdude -p m328p -U lfuse:w:0xff:m -U hfuse:w:0xde:m -U efuse:w:0xfd:m, and read back')
+t.open()
+for op, value in ((0xA0, 0xFF), (0xA8, 0xDE), (0xA4, 0xFD)):
+    rd = {0xA0: (0x50, 0x00), 0xA8: (0x58, 0x08), 0xA4: (0x50, 0x08)}[op]
+    t.x([0x56, rd[0], rd[1], 0x00, 0x00, 0x20], [0x14, '??', 0x10])
+    t.x([0x56, 0xAC, op, 0x00, value, 0x20], [0x14, '??', 0x10])
+    t.wait(4.5)                                                    # max_write_delay
+    t.x([0x56, rd[0], rd[1], 0x00, 0x00, 0x20], [0x14, value, 0x10])
+t.close()